@@ -0,0 +1,259 @@
+/*
+ * The archive index. See archive.h.
+ *
+ * Released in the public domain.
+ */
+
+#define _GNU_SOURCE	/* nftw() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <ftw.h>
+#include <pthread.h>
+#include "sha256.h"
+#include "archive.h"
+
+#define INDEX_HEADER	"fujiplay index 1\n"
+
+struct entry {
+	char id[16];
+	const char *name;	/* in path */
+	long size;
+	char hash[2*SHA256_SIZE+1];
+	struct entry *next;
+	char path[1];		/* allocated with the entry */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct entry **table;	/* hashed by name and size */
+static unsigned long nbuckets, count;
+static int index_fd = -1;
+static char root_dir[PATH_MAX];
+static char prefix[PATH_MAX+1];	/* of the current directory in the archive */
+static FILE *scan_fd;
+
+/* Camera IDs without spaces, "-" if unknown */
+static void clean_id (const char *id, char *out)
+{
+	int i;
+
+	if (id == NULL || !*id)
+		id = "-";
+	for (i = 0; i < 15 && id[i]; i++)
+		out[i] = (id[i] > ' ' && id[i] <= '~') ? id[i] : '_';
+	out[i] = '\0';
+}
+
+static unsigned long hash (const char *name, long size)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*name)
+		h = (h ^ (unsigned char) *name++) * 16777619UL;
+	return (h ^ size) * 16777619UL;
+}
+
+static struct entry *lookup (const char *id, const char *name, long size)
+{
+	struct entry *e;
+
+	if (!nbuckets)
+		return NULL;
+	for (e = table[hash(name, size) & (nbuckets - 1)]; e; e = e->next)
+		if (e->size == size && !strcmp(e->name, name)
+		    && (!strcmp(e->id, id) || !strcmp(e->id, "-") || !strcmp(id, "-")))
+			return e;
+	return NULL;
+}
+
+/* With the lock held */
+static int insert (const char *id, const char *path, long size, const char *hex)
+{
+	struct entry *e, **t, *next;
+	unsigned long i, n;
+	const char *slash;
+
+	if (count >= nbuckets) {
+		n = nbuckets ? 2*nbuckets : 1024;
+		if ((t = calloc(n, sizeof(struct entry *))) == NULL)
+			return -1;
+		for (i = 0; i < nbuckets; i++)
+			for (e = table[i]; e; e = next) {
+				next = e->next;
+				e->next = t[hash(e->name, e->size) & (n - 1)];
+				t[hash(e->name, e->size) & (n - 1)] = e;
+			}
+		free(table);
+		table = t;
+		nbuckets = n;
+	}
+	if ((e = malloc(sizeof(struct entry) + strlen(path))) == NULL)
+		return -1;
+	strcpy(e->path, path);
+	slash = strrchr(e->path, '/');
+	e->name = slash ? slash+1 : e->path;
+	clean_id(id, e->id);
+	e->size = size;
+	sprintf(e->hash, "%.64s", hex);
+	i = hash(e->name, size) & (nbuckets - 1);
+	e->next = table[i];
+	table[i] = e;
+	count++;
+	return 0;
+}
+
+static int load_index (FILE *fd)
+{
+	char line[PATH_MAX+128], id[16], hex[2*SHA256_SIZE+1];
+	long size;
+	int n, len;
+
+	if (fgets(line, sizeof(line), fd) == NULL || strcmp(line, INDEX_HEADER)) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		len = strlen(line);
+		/* An incomplete line is ignored */
+		if (len == 0 || line[len-1] != '\n')
+			continue;
+		line[len-1] = '\0';
+		if (sscanf(line, "%15s %ld %64s %n", id, &size, hex, &n) < 3 || !line[n])
+			continue;
+		if (insert(id, line + n, size, hex) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int is_jpeg (const char *path)
+{
+	int n = strlen(path);
+
+	return (n > 4 && !strcasecmp(path + n - 4, ".jpg"))
+		|| (n > 5 && !strcasecmp(path + n - 5, ".jpeg"));
+}
+
+static int scan_file (const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	char hex[2*SHA256_SIZE+1];
+	const char *rel;
+	long size;
+	int fd;
+
+	if (type != FTW_F || !is_jpeg(path))
+		return 0;
+	rel = path + strlen(root_dir) + 1;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Cannot index %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	size = sha256_fd_hex(fd, hex);
+	close(fd);
+	if (size < 0) {
+		fprintf(stderr, "Cannot index %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	if (insert("-", rel, size, hex) < 0)
+		return -1;
+	fprintf(scan_fd, "- %ld %s %s\n", size, hex, rel);
+	return 0;
+}
+
+/* Index the pictures already there, as of unknown origin */
+static int build_index (const char *path)
+{
+	char tmp[PATH_MAX+32];
+	int ret;
+
+	fprintf(stderr, "Indexing %s...\n", root_dir);
+	sprintf(tmp, "%.*s.%d", PATH_MAX, path, (int) getpid());
+	if ((scan_fd = fopen(tmp, "w")) == NULL)
+		return -1;
+	fputs(INDEX_HEADER, scan_fd);
+	ret = nftw(root_dir, scan_file, 16, FTW_PHYS);
+	if (fclose(scan_fd) != 0 || ret != 0 || rename(tmp, path) < 0) {
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+long archive_open (const char *root)
+{
+	char path[PATH_MAX+32], cwd[PATH_MAX];
+	FILE *fd;
+	int i, n, ret;
+
+	if (realpath(root, root_dir) == NULL || getcwd(cwd, sizeof(cwd)) == NULL)
+		return -1;
+	/* Where the downloads go, relative to the top ("../" if outside) */
+	for (n = i = 0; root_dir[i] && root_dir[i] == cwd[i]; i++)
+		if (root_dir[i] == '/')
+			n = i;
+	if ((!root_dir[i] && (!cwd[i] || cwd[i] == '/'))
+	    || (!cwd[i] && root_dir[i] == '/'))
+		n = i;
+	prefix[0] = '\0';
+	for (i = n; root_dir[i]; i++)
+		if (root_dir[i] == '/' && root_dir[i+1] && strlen(prefix) + 4 < sizeof(prefix))
+			strcat(prefix, "../");
+	if (cwd[n] == '/' && strlen(prefix) + strlen(cwd + n) < sizeof(prefix))
+		sprintf(prefix + strlen(prefix), "%s/", cwd + n + 1);
+	sprintf(path, "%s/%s", root_dir, ARCHIVE_INDEX);
+	pthread_mutex_lock(&lock);
+	if ((fd = fopen(path, "r")) != NULL) {
+		ret = load_index(fd);
+		fclose(fd);
+	} else
+		ret = (errno == ENOENT) ? build_index(path) : -1;
+	if (ret == 0 && (index_fd = open(path, O_WRONLY|O_APPEND)) < 0)
+		ret = -1;
+	pthread_mutex_unlock(&lock);
+	return (ret < 0) ? -1 : (long) count;
+}
+
+int archive_has (const char *id, const char *name, long size)
+{
+	char cid[16];
+	int ret;
+
+	clean_id(id, cid);
+	pthread_mutex_lock(&lock);
+	ret = (lookup(cid, name, size) != NULL);
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void archive_add (const char *id, const char *path, long size, const char *hex)
+{
+	char cid[16], full[2*PATH_MAX], line[2*PATH_MAX+128];
+	const char *slash;
+	struct entry *e;
+	int n;
+
+	clean_id(id, cid);
+	snprintf(full, sizeof(full), "%s%s", prefix, path);
+	slash = strrchr(full, '/');
+	pthread_mutex_lock(&lock);
+	if (index_fd < 0)
+		goto out;
+	/* Downloaded again (with -f), and unchanged */
+	e = lookup(cid, slash ? slash+1 : full, size);
+	if (e != NULL && !strcmp(e->hash, hex) && !strcmp(e->path, full))
+		goto out;
+	if (insert(cid, full, size, hex) < 0)
+		goto out;
+	/* One write per line, so that they are never mixed up */
+	n = snprintf(line, sizeof(line), "%s %ld %s %s\n", cid, size, hex, full);
+	if (write(index_fd, line, n) != n)
+		fprintf(stderr, "Cannot update the archive index: %s\n", strerror(errno));
+out:
+	pthread_mutex_unlock(&lock);
+}
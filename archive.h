@@ -0,0 +1,40 @@
+/*
+ * The archive index: every picture kept under an archive directory, with
+ * the ID of the camera it came from (if known), its size and SHA-256. It
+ * is loaded in memory, so that finding whether a picture of a camera is
+ * already archived takes no access to the disk, wherever it was filed.
+ *
+ * The index is the file .fujiplay-index at the top of the archive: a
+ * header line, then one line per picture, "ID SIZE SHA256 PATH" (ID is
+ * "-" if unknown, PATH is relative to the top, beginning with "../" for
+ * a picture downloaded outside of it). Lines are only appended, so that
+ * several fujiplay may update it.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#define ARCHIVE_INDEX	".fujiplay-index"
+
+/*
+ * Load the index of the archive "root", or build it by hashing the JPEG
+ * files of the tree if there's none. Returns the number of pictures, or
+ * -1 with errno set.
+ */
+long archive_open (const char *root);
+
+/*
+ * Is picture "name" (without directory) of "size" bytes from camera "id"
+ * in the archive? Pictures of unknown origin match any camera.
+ */
+int archive_has (const char *id, const char *name, long size);
+
+/*
+ * Add "path" (relative to the current directory) to the index. Does
+ * nothing if no archive is open. May be called from any thread.
+ */
+void archive_add (const char *id, const char *path, long size, const char *hex);
+
+#endif
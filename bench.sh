@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Benchmark fujiplay against the camera emulator. Each workload is run
+# in a scratch directory; the emulator reports payload throughput,
+# per-command latency and retries. The caches of ~/.fujiplay are not
+# used (-C), so that every run lists the pictures, and HOME points to
+# the scratch directory.
+#
+# Tunables (environment): BENCH_PICS, BENCH_SIZE, BENCH_SPEED,
+# BENCH_FAULTS (emulator options used by the "lossy" profile),
+# BENCH_PROFILES (any of "paced lossy unpaced") and BENCH_FLAGS
+# (fujiplay options, "-l" for instance).
+#
+
+PICS=${BENCH_PICS:-4}
+SIZE=${BENCH_SIZE:-24000}
+SPEED=${BENCH_SPEED:-115200}
+FAULTS=${BENCH_FAULTS:-"-P 0.02 -N 0.02 -X 0.01"}
+PROFILES=${BENCH_PROFILES:-"paced lossy unpaced"}
+FLAGS=${BENCH_FLAGS:-""}
+
+TOP=`pwd`
+EMU="$TOP/fujiemu"
+FUJIPLAY="$TOP/fujiplay"
+WORK=`mktemp -d ${TMPDIR:-/tmp}/fujibench.XXXXXX` || exit 1
+trap 'rm -rf "$WORK"' 0 1 2 15
+HOME="$WORK"
+export HOME
+
+run () {
+	# run PROFILE WORKLOAD EMU-OPTIONS... -- FUJIPLAY-ARGS...
+	echo "=== $1: $2"
+	shift 2
+	"$EMU" -s 1 -o "$WORK/stats" "$@" > "$WORK/stdout" 2> "$WORK/stderr"
+	status=$?
+	cat "$WORK/stats"
+	if [ $status -ne 0 ]; then
+		echo "FAILED (status $status):"
+		cat "$WORK/stderr"
+	fi
+	echo
+}
+
+for profile in $PROFILES; do
+	case $profile in
+	  paced)	opts="-m $SPEED" ;;
+	  lossy)	opts="-m $SPEED $FAULTS" ;;
+	  unpaced)	opts="-m $SPEED -u -t" ;;
+	  *)		echo "Unknown profile $profile"; exit 1 ;;
+	esac
+	mkdir -p "$WORK/$profile" && cd "$WORK/$profile" || exit 1
+	run $profile list $opts -n $PICS -z $SIZE -- "$FUJIPLAY" -C $FLAGS
+	run $profile download-all $opts -n $PICS -z $SIZE -- "$FUJIPLAY" -C $FLAGS all
+	run $profile upload $opts -n 0 -- "$FUJIPLAY" -C $FLAGS upload DSC*.JPG
+	run $profile preview $opts -n 0 -- "$FUJIPLAY" -C $FLAGS preview
+	cd "$TOP"
+done
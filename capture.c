@@ -0,0 +1,141 @@
+/*
+ * Capture files. See capture.h.
+ *
+ * Released in the public domain.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "capture.h"
+#include "stats.h"
+
+static void put_varint (FILE *fd, unsigned long long x)
+{
+	while (x >= 0x80) {
+		putc((x & 0x7F) | 0x80, fd);
+		x >>= 7;
+	}
+	putc(x, fd);
+}
+
+static int get_varint (FILE *fd, unsigned long long *x)
+{
+	int c, shift = 0;
+
+	*x = 0;
+	do {
+		if ((c = getc(fd)) == EOF || shift > 63)
+			return -1;
+		*x |= (unsigned long long) (c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+struct capture *capture_create (const char *path)
+{
+	struct capture *cap;
+	struct timeval tv;
+	unsigned long long t;
+	int i;
+
+	if ((cap = malloc(sizeof(struct capture))) == NULL)
+		return NULL;
+	if ((cap->fd = fopen(path, "w")) == NULL) {
+		free(cap);
+		return NULL;
+	}
+	/* Fully buffered: a record costs a memcpy, most of the time */
+	setvbuf(cap->fd, NULL, _IOFBF, 65536);
+	gettimeofday(&tv, NULL);
+	t = tv.tv_sec * 1000000ULL + tv.tv_usec;
+	fputs(CAPTURE_MAGIC, cap->fd);
+	for (i = 0; i < 8; i++)
+		putc(t >> (8*i), cap->fd);
+	cap->last_us = stats_usec();
+	return cap;
+}
+
+void capture_record (struct capture *cap, int type, const unsigned char *data, int len)
+{
+	long long t = stats_usec();
+
+	putc(type, cap->fd);
+	put_varint(cap->fd, t - cap->last_us);
+	put_varint(cap->fd, len);
+	fwrite(data, 1, len, cap->fd);
+	cap->last_us = t;
+}
+
+void capture_record_int (struct capture *cap, int type, long value)
+{
+	unsigned char b[4];
+
+	b[0] = value;
+	b[1] = value >> 8;
+	b[2] = value >> 16;
+	b[3] = value >> 24;
+	capture_record(cap, type, b, 4);
+}
+
+int capture_close (struct capture *cap)
+{
+	int ret = fclose(cap->fd);
+
+	free(cap);
+	return ret;
+}
+
+FILE *capture_open (const char *path, long long *start_us)
+{
+	unsigned char head[16];
+	FILE *fd;
+	int i;
+
+	if ((fd = fopen(path, "r")) == NULL)
+		return NULL;
+	if (fread(head, 1, 16, fd) != 16 || memcmp(head, CAPTURE_MAGIC, 8)) {
+		fclose(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	*start_us = 0;
+	for (i = 7; i >= 0; i--)
+		*start_us = (*start_us << 8) | head[8+i];
+	return fd;
+}
+
+int capture_read (FILE *fd, struct capture_rec *rec)
+{
+	unsigned long long dt, len;
+	int c;
+
+	if ((c = getc(fd)) == EOF)
+		return 0;
+	if (get_varint(fd, &dt) < 0 || get_varint(fd, &len) < 0 || len > (1 << 24))
+		return -1;
+	if (len > rec->size) {
+		free(rec->data);
+		rec->size = len + 4096;
+		if ((rec->data = malloc(rec->size)) == NULL) {
+			rec->size = 0;
+			return -1;
+		}
+	}
+	if (fread(rec->data, 1, len, fd) != len)
+		return -1;
+	rec->type = c;
+	rec->time_us += dt;
+	rec->len = len;
+	return 1;
+}
+
+long capture_int (const struct capture_rec *rec)
+{
+	if (rec->len < 4)
+		return -1;
+	return rec->data[0] | (rec->data[1] << 8) | (rec->data[2] << 16)
+		| ((long) rec->data[3] << 24);
+}
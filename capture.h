@@ -0,0 +1,57 @@
+/*
+ * Capture files: everything sent and received on a serial link, with
+ * timestamps, for later analysis by fujireplay.
+ *
+ * The file starts with "FUJICAP1" and the wall clock time of its
+ * creation (8 bytes, little-endian, in microseconds since the epoch).
+ * Then come the records: a type byte, the time elapsed since the
+ * previous record (or since the creation) and the length of the data,
+ * both in microseconds and as base-128 varints, then the data itself.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+
+#define CAPTURE_MAGIC	"FUJICAP1"
+
+#define CAPTURE_IN	'I'	/* bytes received, as read (PARMRK) */
+#define CAPTURE_OUT	'O'	/* bytes sent */
+#define CAPTURE_SPEED	'S'	/* new line speed: 4 bytes, in bps */
+#define CAPTURE_TIMEOUT	'T'	/* the host gave up waiting: 4 bytes, in ms */
+
+struct capture {
+	FILE *fd;
+	long long last_us;
+};
+
+struct capture_rec {
+	int type;
+	long long time_us;	/* since the creation of the file */
+	int len;
+	unsigned char *data;	/* allocated by capture_read() */
+	int size;
+};
+
+/* Writing. capture_create() returns NULL with errno set on failure */
+struct capture *capture_create (const char *path);
+void capture_record (struct capture *cap, int type, const unsigned char *data, int len);
+void capture_record_int (struct capture *cap, int type, long value);
+int capture_close (struct capture *cap);
+
+/*
+ * Reading. capture_open() checks the header and returns the creation
+ * time into *start_us. capture_read() returns 1 for a record, 0 at the
+ * end of the file, or -1 if the file is truncated or corrupt; "rec"
+ * must be zeroed before the first call.
+ */
+FILE *capture_open (const char *path, long long *start_us);
+int capture_read (FILE *fd, struct capture_rec *rec);
+
+/* Value of a CAPTURE_SPEED or CAPTURE_TIMEOUT record */
+long capture_int (const struct capture_rec *rec);
+
+#endif
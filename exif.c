@@ -0,0 +1,176 @@
+/*
+ * Minimal Exif parser. See exif.h.
+ *
+ * Released in the public domain.
+ */
+
+#include <string.h>
+#include "exif.h"
+
+/* The TIFF structure inside the APP1 segment */
+struct tiff {
+	const unsigned char *base;
+	long len;
+	int motorola;		/* big-endian */
+};
+
+#define IFD0	0
+#define IFD_EXIF 1
+#define IFD1	2
+
+static int get16 (struct tiff *t, long off)
+{
+	const unsigned char *p = t->base + off;
+
+	return t->motorola ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static long get32 (struct tiff *t, long off)
+{
+	const unsigned char *p = t->base + off;
+
+	if (t->motorola)
+		return ((long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((long)p[3] << 24);
+}
+
+static void get_date (struct tiff *t, long count, long off, char *date)
+{
+	int i;
+
+	if (count < 19 || off < 0 || off + 19 > t->len)
+		return;
+	for (i = 0; i < 19; i++)
+		if (t->base[off+i] < ' ' || t->base[off+i] > '~')
+			return;
+	memcpy(date, t->base + off, 19);
+	date[19] = '\0';
+}
+
+/*
+ * Read the IFD at "off", of the given kind. Returns the offset of the
+ * next IFD, or 0. The offset of the Exif IFD is stored into *exif_ifd.
+ */
+static long read_ifd (struct tiff *t, long off, int kind,
+		      struct exif_info *ex, long *exif_ifd, long *thumb)
+{
+	int n, i, tag, type;
+	long e, count, value;
+
+	if (off < 8 || off + 2 > t->len)
+		return 0;
+	n = get16(t, off);
+	for (i = 0; i < n; i++) {
+		e = off + 2 + 12*i;
+		if (e + 12 > t->len)
+			return 0;
+		tag = get16(t, e);
+		type = get16(t, e+2);
+		count = get32(t, e+4);
+		value = (type == 3) ? get16(t, e+8) : get32(t, e+8);
+		switch (tag) {
+		  case 0x0100:	/* ImageWidth */
+			if (kind == IFD0)
+				ex->width = value;
+			break;
+		  case 0x0101:	/* ImageLength */
+			if (kind == IFD0)
+				ex->height = value;
+			break;
+		  case 0x0132:	/* DateTime */
+			if (type == 2 && !ex->date[0])
+				get_date(t, count, value, ex->date);
+			break;
+		  case 0x8769:	/* Exif IFD */
+			if (kind == IFD0)
+				*exif_ifd = value;
+			break;
+		  case 0x9003:	/* DateTimeOriginal */
+			if (type == 2)
+				get_date(t, count, value, ex->date);
+			break;
+		  case 0xA002:	/* PixelXDimension */
+			if (kind == IFD_EXIF)
+				ex->width = value;
+			break;
+		  case 0xA003:	/* PixelYDimension */
+			if (kind == IFD_EXIF)
+				ex->height = value;
+			break;
+		  case 0x0201:	/* JPEGInterchangeFormat */
+			if (kind == IFD1)
+				thumb[0] = value;
+			break;
+		  case 0x0202:	/* JPEGInterchangeFormatLength */
+			if (kind == IFD1)
+				thumb[1] = value;
+			break;
+		}
+	}
+	e = off + 2 + 12*n;
+	return (e + 4 <= t->len) ? get32(t, e) : 0;
+}
+
+static int read_tiff (struct tiff *t, int base, struct exif_info *ex)
+{
+	long ifd1, exif_ifd = 0, thumb[2] = { 0, 0 };
+
+	if (t->len < 8)
+		return -1;
+	if (!memcmp(t->base, "II\x2a\0", 4))
+		t->motorola = 0;
+	else if (!memcmp(t->base, "MM\0\x2a", 4))
+		t->motorola = 1;
+	else
+		return -1;
+	ifd1 = read_ifd(t, get32(t, 4), IFD0, ex, &exif_ifd, thumb);
+	if (exif_ifd)
+		read_ifd(t, exif_ifd, IFD_EXIF, ex, &exif_ifd, thumb);
+	if (ifd1)
+		read_ifd(t, ifd1, IFD1, ex, &exif_ifd, thumb);
+	if (thumb[0] >= 8 && thumb[1] > 0 && thumb[0] + thumb[1] <= t->len) {
+		ex->thumb_offset = base + thumb[0];
+		ex->thumb_length = thumb[1];
+	}
+	return 0;
+}
+
+int exif_parse (const unsigned char *buf, int len, struct exif_info *ex)
+{
+	struct tiff t;
+	int pos, marker, seglen, found = 0;
+
+	memset(ex, 0, sizeof(*ex));
+	if (len < 4 || buf[0] != 0xFF || buf[1] != 0xD8)
+		return -1;
+	/* Walk the segments, up to the start of the scan */
+	for (pos = 2; pos + 4 <= len; pos += 2 + seglen) {
+		if (buf[pos] != 0xFF)
+			break;
+		marker = buf[pos+1];
+		if (marker == 0xFF) {
+			/* Fill byte */
+			seglen = -1;
+			continue;
+		}
+		if (marker == 0xD9 || marker == 0xDA)
+			break;
+		seglen = (buf[pos+2] << 8) | buf[pos+3];
+		if (seglen < 2)
+			break;
+		if (marker == 0xE1 && !found && pos + 10 <= len
+		    && !memcmp(buf+pos+4, "Exif\0\0", 6)) {
+			t.base = buf + pos + 10;
+			t.len = (pos + 2 + seglen <= len ? pos + 2 + seglen : len)
+				- (pos + 10);
+			found = (read_tiff(&t, pos + 10, ex) == 0);
+		} else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4
+			   && marker != 0xC8 && marker != 0xCC
+			   && !ex->width && pos + 9 <= len) {
+			/* Start of frame: the dimensions, if Exif had none */
+			ex->height = (buf[pos+5] << 8) | buf[pos+6];
+			ex->width = (buf[pos+7] << 8) | buf[pos+8];
+		}
+	}
+	return found ? 0 : -1;
+}
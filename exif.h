@@ -0,0 +1,25 @@
+/*
+ * Minimal Exif parser, for the headers returned by the 0x00 command:
+ * capture date, picture dimensions and the embedded thumbnail.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef EXIF_H
+#define EXIF_H
+
+struct exif_info {
+	char date[20];		/* "YYYY:MM:DD HH:MM:SS", or empty */
+	int width, height;	/* 0 if unknown */
+	int thumb_offset;	/* position of the thumbnail in the buffer */
+	int thumb_length;	/* 0 if none, or not entirely in the buffer */
+};
+
+/*
+ * Parse the beginning of a JPEG file, "len" bytes at "buf". Returns 0 on
+ * success, or -1 if there's no Exif header. A truncated header is not an
+ * error; whatever could be found is returned.
+ */
+int exif_parse (const unsigned char *buf, int len, struct exif_info *ex);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Frame encoder and decoder for the Fujifilm serial protocol.
+ * See frame.h.
+ *
+ * Released in the public domain.
+ */
+
+#include <string.h>
+#include "frame.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Encode a whole frame into "out", which must have room for
+ * FRAME_MAX_ENCODED(len) bytes, and return its length. The DLE
+ * stuffing and the checksum are done in the same pass; with SSE2,
+ * blocks of 16 bytes without any DLE are copied as they are.
+ */
+int frame_encode (unsigned char *out, const unsigned char *data, int len, int last)
+{
+	const unsigned char *p = data, *end = data + len;
+	unsigned char *q = out;
+	int check = last ? ETX : ETB;
+
+	*q++ = DLE;
+	*q++ = STX;
+#ifdef __SSE2__
+	{
+		__m128i dle = _mm_set1_epi8(DLE), acc = _mm_setzero_si128();
+		unsigned char sum[16];
+		int mask, bit, prev, i;
+
+		for (; end - p >= 16; p += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *) p);
+
+			acc = _mm_xor_si128(acc, v);
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, dle));
+			if (!mask) {
+				_mm_storeu_si128((__m128i *) q, v);
+				q += 16;
+				continue;
+			}
+			/* Copy up to and including each DLE, then repeat it */
+			for (prev = 0; mask; mask &= mask - 1) {
+				bit = __builtin_ctz(mask);
+				memcpy(q, p + prev, bit + 1 - prev);
+				q += bit + 1 - prev;
+				*q++ = DLE;
+				prev = bit + 1;
+			}
+			memcpy(q, p + prev, 16 - prev);
+			q += 16 - prev;
+		}
+		_mm_storeu_si128((__m128i *) sum, acc);
+		for (i = 0; i < 16; i++)
+			check ^= sum[i];
+	}
+#endif
+	for (; p < end; p++) {
+		if (*p == DLE)
+			*q++ = DLE;
+		*q++ = *p;
+		check ^= *p;
+	}
+	*q++ = DLE;
+	*q++ = last ? ETX : ETB;
+	*q++ = check;
+	return q - out;
+}
+
+enum { S_START, S_STX, S_DATA, S_DLE, S_CHECK, S_END };
+
+void frame_decoder_init (struct frame_decoder *d, unsigned char *buf, int size, int parmrk)
+{
+	memset(d, 0, sizeof(*d));
+	d->buf = buf;
+	d->size = size;
+	d->parmrk = parmrk;
+	d->state = S_START;
+}
+
+static void frame_error (struct frame_decoder *d, int error)
+{
+	d->status = FRAME_BAD;
+	d->error = error;
+	d->state = S_END;
+}
+
+/*
+ * Copy the payload bytes which need no special treatment (no DLE, and
+ * no 0xFF in PARMRK mode) from the start of "in". Returns how many.
+ */
+static int copy_plain (struct frame_decoder *d, const unsigned char *in, int n)
+{
+	const unsigned char *p = in, *end = in + n;
+	unsigned char *q = d->buf + d->len;
+	int room = d->size - d->len;
+	int ff = d->parmrk ? 0xFF : DLE;
+
+	if (end - p > room)
+		end = p + room;
+#ifdef __SSE2__
+	{
+		__m128i dle = _mm_set1_epi8(DLE), esc = _mm_set1_epi8(ff);
+		__m128i acc = _mm_setzero_si128();
+		unsigned char sum[16];
+		int mask, i;
+
+		for (; end - p >= 16; p += 16, q += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *) p);
+
+			mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(v, dle), _mm_cmpeq_epi8(v, esc)));
+			if (mask) {
+				/* Stop at the first special byte */
+				end = p + __builtin_ctz(mask);
+				break;
+			}
+			acc = _mm_xor_si128(acc, v);
+			_mm_storeu_si128((__m128i *) q, v);
+		}
+		_mm_storeu_si128((__m128i *) sum, acc);
+		for (i = 0; i < 16; i++)
+			d->check ^= sum[i];
+	}
+#endif
+	for (; p < end && *p != DLE && *p != ff; p++) {
+		*q++ = *p;
+		d->check ^= *p;
+	}
+	d->len = q - d->buf;
+	return p - in;
+}
+
+/*
+ * Feed "n" raw bytes to the decoder. Returns how many were consumed;
+ * the rest belongs to whatever follows the frame. d->status tells
+ * whether the frame is complete.
+ */
+int frame_decode (struct frame_decoder *d, const unsigned char *in, int n)
+{
+	int i = 0, c;
+
+	while (i < n && d->state != S_END) {
+		if (d->state == S_DATA && !d->esc) {
+			i += copy_plain(d, in + i, n - i);
+			if (i == n)
+				break;
+		}
+		c = in[i++];
+		if (d->parmrk) {
+			if (d->esc == 1) {
+				d->esc = 0;
+				if (c != 0xFF) {
+					/* 0xFF 0x00 X: skip X as well */
+					d->esc = (c == 0) ? 2 : 0;
+					if (!d->esc)
+						frame_error(d, FRAME_ERR_PARITY);
+					continue;
+				}
+			} else if (d->esc == 2) {
+				frame_error(d, FRAME_ERR_PARITY);
+				continue;
+			} else if (c == 0xFF) {
+				d->esc = 1;
+				continue;
+			}
+		}
+		switch (d->state) {
+		  case S_START:
+			if (c != DLE)
+				frame_error(d, FRAME_ERR_SYNTAX);
+			else
+				d->state = S_STX;
+			break;
+		  case S_STX:
+			if (c != STX)
+				frame_error(d, FRAME_ERR_SYNTAX);
+			else
+				d->state = S_DATA;
+			break;
+		  case S_DLE:
+			if (c == ETX || c == ETB) {
+				d->last = (c == ETX);
+				d->check ^= c;
+				d->state = S_CHECK;
+				break;
+			}
+			/* Normally a doubled DLE */
+			/* FALLTHROUGH */
+		  case S_DATA:
+			if (c == DLE && d->state == S_DATA) {
+				d->state = S_DLE;
+				break;
+			}
+			d->state = S_DATA;
+			if (d->len == d->size) {
+				frame_error(d, FRAME_ERR_OVERFLOW);
+				break;
+			}
+			d->buf[d->len++] = c;
+			d->check ^= c;
+			break;
+		  case S_CHECK:
+			if (c != d->check)
+				frame_error(d, FRAME_ERR_CHECKSUM);
+			else {
+				d->status = FRAME_DONE;
+				d->state = S_END;
+			}
+			break;
+		}
+	}
+	return i;
+}
@@ -0,0 +1,60 @@
+/*
+ * Framing of the Fujifilm serial protocol.
+ *
+ * A frame is DLE STX, the payload with every DLE doubled, then DLE ETX
+ * (last frame) or DLE ETB (more frames follow), and a checksum byte:
+ * the XOR of the payload bytes and of the ETX/ETB byte.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#define STX	0x02
+#define ETX	0x03
+#define EOT	0x04
+#define ENQ	0x05
+#define ACK	0x06
+#define DLE	0x10
+#define NAK	0x15
+#define ETB	0x17
+
+/* Worst case size of an encoded frame with "len" payload bytes */
+#define FRAME_MAX_ENCODED(len)	(2*(len) + 5)
+
+int frame_encode (unsigned char *out, const unsigned char *data, int len, int last);
+
+/*
+ * Incremental decoder. Raw input is fed in chunks of any size; the
+ * payload is written directly into the caller's buffer. With "parmrk"
+ * set, the input is assumed to come from a tty in PARMRK mode: 0xFF is
+ * escaped as 0xFF 0xFF, and 0xFF 0x00 X flags a parity or framing error
+ * on X.
+ */
+struct frame_decoder {
+	unsigned char *buf;	/* destination */
+	int size;		/* capacity of buf */
+	int len;		/* payload bytes so far */
+	int check;
+	int state;
+	int esc;		/* position in a PARMRK escape sequence */
+	int parmrk;
+	int last;		/* DLE ETX (rather than DLE ETB) was seen */
+	int status;		/* FRAME_MORE, FRAME_DONE or FRAME_BAD */
+	int error;		/* why the frame is bad */
+};
+
+#define FRAME_MORE	0
+#define FRAME_DONE	1
+#define FRAME_BAD	(-1)
+
+#define FRAME_ERR_SYNTAX	1	/* no DLE STX at the start */
+#define FRAME_ERR_PARITY	2	/* parity or framing error */
+#define FRAME_ERR_OVERFLOW	3	/* payload larger than the buffer */
+#define FRAME_ERR_CHECKSUM	4
+
+void frame_decoder_init (struct frame_decoder *d, unsigned char *buf, int size, int parmrk);
+int frame_decode (struct frame_decoder *d, const unsigned char *in, int n);
+
+#endif
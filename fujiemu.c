@@ -0,0 +1,951 @@
+/*
+ * A Fujifilm camera emulator, for testing and benchmarking fujiplay
+ * without a real camera. It opens a pseudo-terminal and answers on
+ * the master side like an MX-700 would on the other end of the serial
+ * cable: DLE/STX framing, ENQ/ACK/NAK handshake, speed changes, and
+ * the commands described in mx700-commands.html.
+ *
+ * The line speed is modeled (each byte takes 11 bit times, as with
+ * 8E1 framing), and faults can be injected: corrupted bytes (what a
+ * parity error looks like once it got through), NAKs and dropped
+ * frames. At exit, per-command statistics are printed.
+ *
+ * This code is deliberately simple and byte-oriented, so that it can
+ * serve as a reference when the framing code in fujiplay is optimized.
+ *
+ * Written for fujiplay and released in the public domain.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_PICTURES	9999
+#define PACKET_SIZE	512
+#define PREVIEW_W	80
+#define PREVIEW_H	60
+
+struct picture {
+	char name[16];
+	unsigned char *data;
+	int size;
+};
+
+struct op_stats {
+	int calls;
+	int retries;
+	long bytes;
+	double total_ms;
+	double max_ms;
+};
+
+struct speed_info {
+	int number;
+	int speed;
+};
+
+struct speed_info speeds[] = {
+	{ 8, 115200 },
+	{ 7,  57600 },
+	{ 6,  38400 },
+	{ 4,  19200 },
+	{ 0,   9600 },
+	{ -1, 0 }
+};
+
+int master = -1;
+int max_speed = 115200;
+int speed = 9600;
+int pending_speed = 0;
+int paced = 1;
+int think = 1;
+double p_corrupt = 0, p_nak = 0, p_drop = 0;
+long card_size = 16L << 20;
+int flash_mode = 3;
+char camera_id[11] = "FUJIPLAY  ";
+char camera_date[15] = "19990223120000";
+char upload_name[13];
+unsigned char *upload_data;
+int upload_len;
+int preview_count;
+
+struct picture pics[MAX_PICTURES+1];
+int pictures;
+int next_number = 1;
+
+struct op_stats stats[256];
+long wire_tx, wire_rx;
+int injected_corrupt, injected_nak, injected_drop;
+double link_clock;
+volatile sig_atomic_t child_done = 0, stop = 0;
+
+unsigned char inbuf[4096];
+int inpos, inlen;
+
+static double now_ms (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void sleep_until (double t)
+{
+	struct timespec ts;
+	double d = t - now_ms();
+
+	if (d <= 0)
+		return;
+	ts.tv_sec = (time_t)(d / 1000);
+	ts.tv_nsec = (long)((d - ts.tv_sec * 1000.0) * 1e6);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		continue;
+}
+
+static double byte_ms (void)
+{
+	/* Start bit, 8 data bits, parity and stop bit */
+	return paced ? 11000.0 / speed : 0;
+}
+
+static int chance (double p)
+{
+	return p > 0 && rand() < p * RAND_MAX;
+}
+
+/*
+ * Get one byte from the host, waiting at most "msec" milliseconds.
+ * Returns -1 on timeout.
+ */
+static int emu_getc (int msec)
+{
+	struct pollfd pfd;
+	int ret;
+
+	while (inpos == inlen) {
+		pfd.fd = master;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, msec);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		ret = read(master, inbuf, sizeof(inbuf));
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (ret <= 0)
+			return -1;
+		inpos = 0;
+		inlen = ret;
+		wire_rx += ret;
+	}
+	return inbuf[inpos++];
+}
+
+/*
+ * Send bytes to the host at the current line speed. Each chunk is
+ * only written when the UART would have finished shifting it out.
+ */
+static void emu_write (const unsigned char *buf, int n)
+{
+	int chunk, ret;
+	double now;
+
+	while (n > 0) {
+		chunk = n > 16 ? 16 : n;
+		now = now_ms();
+		if (link_clock < now)
+			link_clock = now;
+		link_clock += chunk * byte_ms();
+		sleep_until(link_clock);
+		ret = write(master, buf, chunk);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return;
+		}
+		wire_tx += ret;
+		buf += ret;
+		n -= ret;
+	}
+}
+
+static void emu_putc (int c)
+{
+	unsigned char b = c;
+
+	emu_write(&b, 1);
+}
+
+/*
+ * Receive a frame, the leading DLE STX having already been read.
+ * Returns the payload length, or -1 if the frame is bad.
+ */
+static int recv_frame (unsigned char *buf, int size, int *last, double t0)
+{
+	int c, n = 0, check = 0, raw = 2;
+
+	while (1) {
+		if ((c = emu_getc(500)) < 0)
+			return -1;
+		raw++;
+		if (c == 0x10) {
+			if ((c = emu_getc(500)) < 0)
+				return -1;
+			raw++;
+			if (c == 0x03 || c == 0x17) {
+				*last = (c == 0x03);
+				break;
+			}
+			if (c != 0x10)
+				return -1;
+		}
+		if (n == size)
+			return -1;
+		buf[n++] = c;
+		check ^= c;
+	}
+	check ^= (*last ? 0x03 : 0x17);
+	c = emu_getc(500);
+	raw++;
+	/* The host bytes had to cross the wire, too */
+	sleep_until(t0 + raw * byte_ms());
+	if (c != check)
+		return -1;
+	if (n < 4 || buf[2] + (buf[3] << 8) != n - 4)
+		return -1;
+	return n;
+}
+
+static int build_frame (unsigned char *out, const unsigned char *data, int len, int last)
+{
+	int i, n = 0, check;
+
+	check = last ? 0x03 : 0x17;
+	out[n++] = 0x10;
+	out[n++] = 0x02;
+	for (i = 0; i < len; i++) {
+		if (data[i] == 0x10)
+			out[n++] = 0x10;
+		out[n++] = data[i];
+		check ^= data[i];
+	}
+	out[n++] = 0x10;
+	out[n++] = last ? 0x03 : 0x17;
+	out[n++] = check;
+	return n;
+}
+
+/*
+ * Send an answer to command "op", split in packets. Each packet must
+ * be acknowledged by the host. Returns -1 if the host gave up.
+ */
+static int send_answer (int op, const unsigned char *data, int len)
+{
+	unsigned char pkt[4+PACKET_SIZE], frame[2*(4+PACKET_SIZE)+5];
+	struct op_stats *st = &stats[op];
+	int chunk, n, c, tries, pos, last;
+
+	pos = 0;
+	do {
+		chunk = len - pos;
+		if (chunk > PACKET_SIZE)
+			chunk = PACKET_SIZE;
+		last = (pos + chunk == len);
+		pkt[0] = 0;
+		pkt[1] = op;
+		pkt[2] = chunk;
+		pkt[3] = chunk >> 8;
+		memcpy(pkt+4, data+pos, chunk);
+		n = build_frame(frame, pkt, 4+chunk, last);
+		tries = 0;
+resend:
+		if (chance(p_drop)) {
+			injected_drop++;
+		} else if (chance(p_corrupt)) {
+			unsigned char bad[sizeof(frame)];
+			int i = 2 + rand() % (n - 5);
+
+			/* Do not touch the framing itself */
+			memcpy(bad, frame, n);
+			if (bad[i] != 0x10 && bad[i] != 0x11 && bad[i-1] != 0x10)
+				bad[i] ^= 0x01;
+			else
+				bad[n-1] ^= 0x01;
+			injected_corrupt++;
+			emu_write(bad, n);
+		} else
+			emu_write(frame, n);
+		c = emu_getc(3000);
+		if (c != 0x06) {
+			st->retries++;
+			if (++tries > 5)
+				return -1;
+			/* Let the host finish draining its input */
+			while (emu_getc(20) >= 0)
+				continue;
+			goto resend;
+		}
+		st->bytes += chunk;
+		pos += chunk;
+	} while (!last);
+	return 0;
+}
+
+static int get_int (const unsigned char *p)
+{
+	return p[0] + (p[1] << 8);
+}
+
+static void put_long (unsigned char *p, long x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+static long used_space (void)
+{
+	long used = 0;
+	int i;
+
+	for (i = 1; i <= pictures; i++)
+		used += (pics[i].size + 511) & ~511;
+	return used;
+}
+
+static struct picture *add_picture (const char *name, unsigned char *data, int size)
+{
+	struct picture *pi;
+	int num;
+
+	if (pictures == MAX_PICTURES)
+		return NULL;
+	pi = &pics[++pictures];
+	strncpy(pi->name, name, 12);
+	pi->name[12] = '\0';
+	pi->data = data;
+	pi->size = size;
+	num = atoi(name + strcspn(name, "0123456789"));
+	if (num >= next_number)
+		next_number = num + 1;
+	return pi;
+}
+
+/*
+ * Fake pictures: a valid Exif header (date, dimensions, thumbnail),
+ * a SOF0 segment and random entropy-coded data. The data is biased
+ * towards 0x10 so that DLE stuffing gets exercised.
+ */
+static void put_ifd_entry (unsigned char *p, int tag, int type, long count, long value)
+{
+	p[0] = tag; p[1] = tag >> 8;
+	p[2] = type; p[3] = 0;
+	put_long(p+4, count);
+	put_long(p+8, value);
+}
+
+static int fill_entropy (unsigned char *p, int n)
+{
+	int i = 0, c;
+
+	while (i < n) {
+		c = rand() & 0xFF;
+		if ((rand() & 15) == 0)
+			c = 0x10;
+		p[i++] = c;
+		if (c == 0xFF && i < n)
+			p[i++] = 0;
+	}
+	if (p[n-1] == 0xFF)
+		p[n-1] = 0;
+	return n;
+}
+
+static int put_sof (unsigned char *p, int w, int h)
+{
+	static const unsigned char sof[] = {
+		0xFF, 0xC0, 0x00, 0x11, 0x08, 0, 0, 0, 0, 0x03,
+		0x01, 0x21, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01 };
+
+	memcpy(p, sof, sizeof(sof));
+	p[5] = h >> 8; p[6] = h;
+	p[7] = w >> 8; p[8] = w;
+	return sizeof(sof);
+}
+
+/* Start of scan, for the three components of put_sof() */
+static int put_sos (unsigned char *p)
+{
+	static const unsigned char sos[] = {
+		0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x11,
+		0x03, 0x11, 0x00, 0x3F, 0x00 };
+
+	memcpy(p, sos, sizeof(sos));
+	return sizeof(sos);
+}
+
+static unsigned char *make_picture (int number, int size, int *psize)
+{
+	unsigned char *buf, *t;
+	int tlen = 1024 + rand() % 1024, app1, n, i;
+	char date[24];
+
+	if (size < 400 + tlen)
+		size = 400 + tlen;
+	buf = calloc(size, 1);
+	sprintf(date, "1999:02:23 %02d:%02d:%02d",
+		(number / 3600) % 24, (number / 60) % 60, number % 60);
+
+	/* SOI, APP1 "Exif", little-endian TIFF header at offset 12 */
+	buf[0] = 0xFF; buf[1] = 0xD8;
+	buf[2] = 0xFF; buf[3] = 0xE1;
+	memcpy(buf+6, "Exif\0\0II\x2a\0\x08\0\0\0", 14);
+	t = buf + 12;
+
+	/* IFD0: Make, DateTime, Exif IFD pointer */
+	t[8] = 3;
+	put_ifd_entry(t+10, 0x010F, 2, 9, 50);
+	put_ifd_entry(t+22, 0x0132, 2, 20, 60);
+	put_ifd_entry(t+34, 0x8769, 4, 1, 80);
+	put_long(t+46, 142);
+	memcpy(t+50, "FUJIFILM", 9);
+	memcpy(t+60, date, 20);
+
+	/* Exif IFD: DateTimeOriginal, PixelXDimension, PixelYDimension */
+	t[80] = 3;
+	put_ifd_entry(t+82, 0x9003, 2, 20, 122);
+	put_ifd_entry(t+94, 0xA002, 4, 1, 1280);
+	put_ifd_entry(t+106, 0xA003, 4, 1, 960);
+	memcpy(t+122, date, 20);
+
+	/* IFD1: the thumbnail */
+	t[142] = 2;
+	put_ifd_entry(t+144, 0x0201, 4, 1, 172);
+	put_ifd_entry(t+156, 0x0202, 4, 1, tlen);
+	n = 172;
+	t[n++] = 0xFF; t[n++] = 0xD8;
+	n += put_sof(t+n, 160, 120);
+	n += put_sos(t+n);
+	n += fill_entropy(t+n, 172 + tlen - 2 - n);
+	t[n++] = 0xFF; t[n++] = 0xD9;
+
+	app1 = 2 + 6 + n;
+	buf[4] = app1 >> 8;
+	buf[5] = app1;
+
+	/* The main image */
+	i = 4 + app1;
+	i += put_sof(buf+i, 1280, 960);
+	i += put_sos(buf+i);
+	fill_entropy(buf+i, size - 2 - i);
+	buf[size-2] = 0xFF;
+	buf[size-1] = 0xD9;
+	*psize = size;
+	return buf;
+}
+
+static void new_picture (int size)
+{
+	char name[16];
+	unsigned char *data;
+	int len;
+
+	data = make_picture(next_number, size, &len);
+	sprintf(name, "DSC%05d.JPG", next_number % 100000);
+	add_picture(name, data, len);
+}
+
+static int load_picture (const char *file)
+{
+	struct stat st;
+	unsigned char *data;
+	const char *p;
+	char name[16];
+	FILE *fd;
+
+	fd = fopen(file, "r");
+	if (fd == NULL || fstat(fileno(fd), &st) < 0) {
+		perror(file);
+		return -1;
+	}
+	data = malloc(st.st_size + 1);
+	if (fread(data, 1, st.st_size, fd) != st.st_size) {
+		perror(file);
+		return -1;
+	}
+	fclose(fd);
+	if ((p = strrchr(file, '/')) != NULL)
+		file = p+1;
+	if (strlen(file) == 12 && !memcmp(file, "DSC", 3))
+		strcpy(name, file);
+	else
+		sprintf(name, "DSC%05d.JPG", next_number % 100000);
+	add_picture(name, data, st.st_size);
+	return 0;
+}
+
+static int preview_data (unsigned char *buf)
+{
+	int x, y;
+	unsigned char *p = buf + 4;
+
+	buf[0] = PREVIEW_W; buf[1] = 0;
+	buf[2] = PREVIEW_H; buf[3] = 0;
+	for (y = 0; y < PREVIEW_H; y++)
+		for (x = 0; x < PREVIEW_W; x += 2) {
+			*p++ = 16 + (x * 219) / PREVIEW_W;
+			*p++ = 16 + ((x+1) * 219) / PREVIEW_W;
+			*p++ = 16 + (y * 224) / PREVIEW_H;
+			*p++ = 128 + ((x + preview_count) % 64) - 32;
+		}
+	preview_count++;
+	return p - buf;
+}
+
+static void account (struct op_stats *st, double t0)
+{
+	double t = now_ms() - t0;
+
+	st->calls++;
+	st->total_ms += t;
+	if (t > st->max_ms)
+		st->max_ms = t;
+}
+
+/* Rough processing times of the real camera, in milliseconds */
+static int think_time (int op)
+{
+	if (!think)
+		return 0;
+	switch (op) {
+	  case 0x27: return 800;
+	  case 0x34: return 500;
+	  case 0x64: return 300;
+	  case 0x19: return 100;
+	  case 0x0b: return 20;
+	  case 0x00:
+	  case 0x02: return 30;
+	  case 0x0e: return 5;
+	}
+	return 2;
+}
+
+/* What command 0x51 reports, in 1/10 seconds */
+static int command_info (int op)
+{
+	switch (op) {
+	  case 0x27:
+	  case 0x34: return 40;
+	  case 0x64: return 20;
+	  case 0x19: return 10;
+	}
+	return 5;
+}
+
+static const unsigned char command_set[] = {
+	0x00, 0x02, 0x07, 0x09, 0x0A, 0x0B, 0x0C, 0x0E, 0x0F, 0x11, 0x13, 0x15,
+	0x17, 0x19, 0x1B, 0x27, 0x29, 0x30, 0x32, 0x34, 0x4C, 0x51, 0x62, 0x64,
+	0x80, 0x82, 0x84, 0x86, 0xC0, 0x20, 0x22, 0x2A, 0x2B };
+
+/*
+ * Execute a command from the host. The command has already been
+ * acknowledged; "pkt" holds the payload with its 4-byte header.
+ */
+static void do_command (unsigned char *pkt, int n, int last, double t0)
+{
+	static unsigned char out[4+PREVIEW_W*PREVIEW_H*2];
+	unsigned char *arg = pkt + 4, *data = out;
+	int op = pkt[1], alen = n - 4, len = 0, i;
+	struct op_stats *st = &stats[op];
+	struct picture *pi;
+
+	sleep_until(now_ms() + think_time(op));
+	memset(out, 0, 16);
+	switch (op) {
+	  case 0x00:
+	  case 0x02:
+	  case 0x0a:
+	  case 0x17:
+	  case 0x19:
+		i = get_int(arg);
+		if (alen < 2 || i < 1 || i > pictures) {
+			len = 1;
+			out[0] = 1;
+			break;
+		}
+		pi = &pics[i];
+		if (op == 0x02) {
+			data = pi->data;
+			len = pi->size;
+		} else if (op == 0x00) {
+			/* Enough to get the whole Exif header */
+			data = pi->data;
+			len = pi->size;
+			if (len > 8 && pi->data[2] == 0xFF && pi->data[3] == 0xE1)
+				len = 4 + (pi->data[4] << 8) + pi->data[5];
+			if (len > pi->size)
+				len = pi->size;
+		} else if (op == 0x0a) {
+			strcpy((char *)out, pi->name);
+			len = strlen(pi->name);
+		} else if (op == 0x17) {
+			put_long(out, pi->size);
+			len = 4;
+		} else {
+			free(pi->data);
+			memmove(pi, pi+1, (pictures - i) * sizeof(*pi));
+			pictures--;
+			len = 1;
+		}
+		break;
+	  case 0x07:
+		len = 1;
+		out[0] = 1;
+		for (i = 0; speeds[i].number >= 0; i++)
+			if (alen == 1 && arg[0] == speeds[i].number
+			    && speeds[i].speed <= max_speed) {
+				pending_speed = speeds[i].speed;
+				out[0] = 0;
+			}
+		break;
+	  case 0x09:
+		strcpy((char *)out, "01.00,MX-700");
+		len = strlen((char *)out);
+		break;
+	  case 0x0b:
+		out[0] = pictures;
+		out[1] = pictures >> 8;
+		len = 2;
+		break;
+	  case 0x0c:
+		break;
+	  case 0x0e:
+		upload_data = realloc(upload_data, upload_len + alen);
+		memcpy(upload_data + upload_len, arg, alen);
+		upload_len += alen;
+		st->bytes += alen;
+		if (last) {
+			if (upload_name[0] && used_space() + upload_len <= card_size)
+				add_picture(upload_name, upload_data, upload_len);
+			else
+				free(upload_data);
+			upload_data = NULL;
+			upload_len = 0;
+			upload_name[0] = '\0';
+		}
+		account(st, t0);
+		return;		/* No answer, the ACK is enough */
+	  case 0x0f:
+		len = 1;
+		out[0] = 1;
+		if (alen == 12) {
+			memcpy(upload_name, arg, 12);
+			upload_name[12] = '\0';
+			out[0] = 0;
+			for (i = 1; i <= pictures; i++)
+				if (!strcmp(pics[i].name, upload_name))
+					out[0] = 1;
+		}
+		free(upload_data);
+		upload_data = NULL;
+		upload_len = 0;
+		break;
+	  case 0x15:
+		if (pictures)
+			strcpy((char *)out, pics[pictures].name);
+		len = strlen((char *)out);
+		break;
+	  case 0x1b:
+		out[0] = 0;
+		put_long(out+1, (card_size - used_space()) & ~511L);
+		len = 5;
+		break;
+	  case 0x27:
+		new_picture(40000 + rand() % 20000);
+		out[0] = pictures;
+		out[1] = pictures >> 8;
+		len = 4;
+		break;
+	  case 0x29:
+		strcpy((char *)out, "DIGCAM\\MX-700\\FUJIFILM");
+		len = strlen((char *)out);
+		break;
+	  case 0x30:
+		out[0] = flash_mode;
+		len = 1;
+		break;
+	  case 0x32:
+		if (alen == 1 && arg[0] < 4)
+			flash_mode = arg[0];
+		else
+			out[0] = 1;
+		len = 1;
+		break;
+	  case 0x34:
+		len = 1;
+		break;
+	  case 0x4c:
+		memcpy(out, command_set, sizeof(command_set));
+		len = sizeof(command_set);
+		break;
+	  case 0x51:
+		out[0] = command_info(alen ? arg[0] : 0);
+		len = 2;
+		break;
+	  case 0x62:
+		len = preview_data(out);
+		break;
+	  case 0x64:
+		len = 2;
+		break;
+	  case 0x80:
+		memcpy(out, camera_id, 10);
+		len = 10;
+		break;
+	  case 0x82:
+		memset(camera_id, ' ', 10);
+		memcpy(camera_id, arg, alen > 10 ? 10 : alen);
+		len = 1;
+		break;
+	  case 0x84:
+		memcpy(out, camera_date, 14);
+		len = 14;
+		break;
+	  case 0x86:
+		if (alen == 14)
+			memcpy(camera_date, arg, 14);
+		else
+			out[0] = 1;
+		len = 1;
+		break;
+	}
+	if (send_answer(op, data, len) < 0)
+		fprintf(stderr, "fujiemu: host gave up on command %02x\n", op);
+	account(st, t0);
+}
+
+static int is_known (int op)
+{
+	int i;
+
+	for (i = 0; i < sizeof(command_set); i++)
+		if (command_set[i] == op)
+			return 1;
+	return 0;
+}
+
+static void serve (void)
+{
+	unsigned char pkt[8192];
+	int c, n, last;
+	double t0;
+
+	while (!stop) {
+		c = emu_getc(100);
+		if (c < 0) {
+			if (child_done)
+				break;
+			continue;
+		}
+		switch (c) {
+		  case 0x05:	/* ENQ */
+			emu_putc(0x06);
+			continue;
+		  case 0x04:	/* EOT: end of session, or speed change */
+			speed = pending_speed ? pending_speed : 9600;
+			pending_speed = 0;
+			continue;
+		  case 0x10:
+			break;
+		  default:
+			continue;
+		}
+		t0 = now_ms();
+		if (emu_getc(500) != 0x02)
+			continue;
+		n = recv_frame(pkt, sizeof(pkt), &last, t0);
+		if (n < 0) {
+			/* Wait for the line to be idle before complaining */
+			while (emu_getc(20) >= 0)
+				continue;
+			emu_putc(0x15);
+			continue;
+		}
+		if (chance(p_nak) || !is_known(pkt[1])) {
+			if (is_known(pkt[1]))
+				injected_nak++;
+			stats[pkt[1]].retries++;
+			emu_putc(0x15);
+			continue;
+		}
+		emu_putc(0x06);
+		do_command(pkt, n, last, t0);
+	}
+}
+
+static void print_stats (FILE *out, double elapsed)
+{
+	long payload = 0;
+	int op, retries = 0;
+	struct op_stats *st;
+
+	fprintf(out, " op   calls  retries     bytes    avg ms    max ms\n");
+	for (op = 0; op < 256; op++) {
+		st = &stats[op];
+		if (!st->calls && !st->retries)
+			continue;
+		fprintf(out, " %02x  %6d  %7d  %8ld  %8.1f  %8.1f\n", op, st->calls,
+			st->retries, st->bytes,
+			st->calls ? st->total_ms / st->calls : 0.0, st->max_ms);
+		payload += st->bytes;
+		retries += st->retries;
+	}
+	fprintf(out, "total: %.3f s, %ld payload bytes, %.0f bytes/s, "
+		"%d retries, wire %ld out/%ld in\n", elapsed / 1000, payload,
+		elapsed > 0 ? payload * 1000.0 / elapsed : 0.0,
+		retries, wire_tx, wire_rx);
+	if (injected_corrupt || injected_nak || injected_drop)
+		fprintf(out, "injected: %d corrupted, %d NAKs, %d dropped\n",
+			injected_corrupt, injected_nak, injected_drop);
+}
+
+static void sigchld_handler (int sig)
+{
+	child_done = 1;
+}
+
+static void sigterm_handler (int sig)
+{
+	stop = 1;
+}
+
+const char *Usage = "\
+Usage: fujiemu [OPTIONS] [JPEG FILES...] [-- COMMAND [ARGS...]]\n\
+Emulate a camera on a pseudo-terminal. The COMMAND is run with the\n\
+arguments \"-D /dev/pts/N\" inserted; without it, the device name is\n\
+printed and the emulator runs until interrupted.\n\
+Options:\n\
+  -m SPEED	Maximum speed supported by the camera (default 115200)\n\
+  -u		Unpaced: do not model the line speed\n\
+  -t		Do not model camera processing times\n\
+  -n COUNT	Create COUNT synthetic pictures\n\
+  -z SIZE	Size of synthetic pictures (default 60000)\n\
+  -c KB		Card capacity (default 16384 kb)\n\
+  -P RATE	Probability of corrupting a frame (parity error)\n\
+  -N RATE	Probability of NAKing a command\n\
+  -X RATE	Probability of dropping a frame\n\
+  -s SEED	Random seed\n\
+  -o FILE	Write statistics to FILE instead of stderr\n\
+";
+
+int main (int argc, char **argv)
+{
+	int i, c, status = 0, count = 0, size = 60000, slave;
+	char *slavename, *statfile = NULL, **cargv;
+	struct sigaction sa;
+	double t_start;
+	pid_t pid = -1;
+	FILE *out;
+
+	while ((c = getopt(argc, argv, "+m:utn:z:c:P:N:X:s:o:h")) != EOF)
+	switch (c) {
+		case 'm': max_speed = atoi(optarg); break;
+		case 'u': paced = 0; break;
+		case 't': think = 0; break;
+		case 'n': count = atoi(optarg); break;
+		case 'z': size = atoi(optarg); break;
+		case 'c': card_size = atol(optarg) << 10; break;
+		case 'P': p_corrupt = atof(optarg); break;
+		case 'N': p_nak = atof(optarg); break;
+		case 'X': p_drop = atof(optarg); break;
+		case 's': srand(atoi(optarg)); break;
+		case 'o': statfile = optarg; break;
+		default:
+			fprintf(stderr, Usage);
+			return 1;
+	}
+	/* getopt() eats the "--" if there are no files before it */
+	if (strcmp(argv[optind-1], "--"))
+		for (; optind < argc && strcmp(argv[optind], "--"); optind++)
+			if (load_picture(argv[optind]) < 0)
+				return 1;
+	if (optind < argc && !strcmp(argv[optind], "--"))
+		optind++;
+	for (i = 0; i < count; i++)
+		new_picture(size);
+
+	master = posix_openpt(O_RDWR|O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0
+	    || (slavename = ptsname(master)) == NULL) {
+		perror("Cannot create pseudo-terminal");
+		return 1;
+	}
+	fcntl(master, F_SETFD, FD_CLOEXEC);
+	/* Keep the slave open, so that its settings survive the clients */
+	slave = open(slavename, O_RDWR|O_NOCTTY);
+	if (slave < 0) {
+		perror(slavename);
+		return 1;
+	}
+	fcntl(slave, F_SETFD, FD_CLOEXEC);
+
+	sa.sa_handler = sigchld_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+	sa.sa_handler = sigterm_handler;
+	sa.sa_flags = 0;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	t_start = now_ms();
+	if (optind < argc) {
+		/* Insert "-D device" after the program name */
+		cargv = calloc(argc - optind + 3, sizeof(char *));
+		cargv[0] = argv[optind];
+		cargv[1] = "-D";
+		cargv[2] = slavename;
+		for (i = optind+1; i < argc; i++)
+			cargv[i - optind + 2] = argv[i];
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			execvp(cargv[0], cargv);
+			perror(cargv[0]);
+			_exit(127);
+		}
+	} else {
+		printf("%s\n", slavename);
+		fflush(stdout);
+	}
+	serve();
+	if (pid > 0) {
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			continue;
+		status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+	}
+	out = statfile ? fopen(statfile, "w") : stderr;
+	if (out == NULL) {
+		perror(statfile);
+		out = stderr;
+	}
+	print_stats(out, now_ms() - t_start);
+	return status;
+}
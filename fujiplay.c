@@ -8,35 +8,47 @@
  * and released in the public domain.
  */
 
+#define _GNU_SOURCE	/* O_TMPFILE, fallocate() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <termios.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/times.h>
 #include <sys/types.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
+#include "libfujiplay.h"
+#include "exif.h"
+#include "preview.h"
+#include "verify.h"
+#include "archive.h"
 
 #ifndef CLK_TCK
 #include <sys/param.h>
 #define CLK_TCK HZ
 #endif
 
-#if !defined(B57600) && defined(EXTA)
-#define B57600 EXTA
-#endif
-
-#if !defined(B115200) && defined(EXTB)
-#define B115200 EXTB
-#endif
-
 #define DEFAULT_DEVICE	"/dev/fujifilm"
-#define TMP_PIC_FILE	".dsc_temp"
+#define TMP_PIC_FILE	".dsc_tempXXXXXX"
+#define CACHE_DIR	".fujiplay"	/* in $HOME */
+#define MAX_LINKS	32
+#define WRITE_BUFFERS	64
+#define MANIFEST_FILE	"SHA256SUMS"
+
+/*
+ * Several cameras can be driven at the same time, one thread per
+ * serial link, each with its own session of the library. The rest of
+ * the state of a link is private to its thread.
+ */
+#define PER_LINK	__thread
 
 struct pict_info {
 	char *name;
@@ -44,480 +56,1007 @@ struct pict_info {
 	int size;
 	short ondisk;
 	short transferred;
+	short deleted;		/* 1 if deleted, -1 if it must stay */
+	int verified;		/* VERIFY_*, once transferred */
 };
 
-struct baudrate_info {
-	int number;
-	int posix_speed;
-	int speed;
+/*
+ * A picture to download, queued by a link (see ingest()). It's
+ * committed by the writer thread: "committed" and "transferred" are
+ * set under stats_lock.
+ */
+struct job {
+	struct link *link;
+	int frame;
+	char *name;
+	int size;
+	double t0;
+	clock_t t1, t2;		/* start and end of the transfer */
+	int committed;
+	int transferred;
+	int verified;
+	int deleted;		/* as in struct pict_info */
 };
 
-struct baudrate_info brinfo[] = {
-#ifdef B115200
-	{ 8, B115200, 115200 },
-#endif
-#ifdef B57600
-	{ 7,  B57600,  57600 },
-#endif
-	{ 6,  B38400,  38400 },
-	{ 4,  B19200,  19200 },
-	{ 0,   B9600,   9600 }
+/* A picture being completed by the writer thread (see commit_picture()) */
+struct commit {
+	struct link *link;
+	struct pict_info *pi;
+	int n;
+	double t0;
+	clock_t t1, t2;
+};
+
+struct link {
+	char *device;
+	char tag[32];
+	char id[16];		/* of the camera, for the archive index */
+	pthread_t thread;
+	int status;
+	int pictures;
+	long bytes;
+	double seconds;
+	struct fuji_session *ses;
+
+	/* Downloads, driven by the engine */
+	int queued;
+	struct job *jobs;
+	int njobs, next;
+	int deleting, deleted;	/* the job being deleted, and the count */
+	struct outfile *out;
+	struct fuji_sink sink;
+	int commit_error;	/* set by the writer thread */
+	int parked;		/* waiting for its pictures to be committed */
+	unsigned char cmd[6];
+};
+
+/*
+ * Output files. A picture is written into an anonymous temporary file
+ * (O_TMPFILE) if the filesystem supports it, or else into a uniquely
+ * named one, preallocated to the announced size and filled by offset;
+ * it only appears under its real name once complete. The "stream"
+ * variant (fd 1 for instance) is just written sequentially. With "-T",
+ * the pictures go into a tar archive instead (see tar_create()).
+ */
+struct outfile {
+	int fd;
+	int stream;
+	int tar;		/* a member of the tar archive (-T) */
+	long size;
+	long written;
+	int error;		/* errno of the first failed write */
+	unsigned char *mem;	/* in memory, "size" bytes at most */
+	struct preview *preview;	/* preview, converted on the fly */
+	struct live *live;	/* live view statistics */
+	char dir[256];
+	char tmpname[300];	/* empty with O_TMPFILE */
+	char member[100];	/* its name in the archive (-T) */
+	/* Called by the writer thread once the frame is written, if set */
+	void (*done) (struct outfile *of);
+	void *arg;
+};
+
+/*
+ * Live view statistics. The time each frame in flight was taken is kept
+ * until the writer thread has completed it (there cannot be more frames
+ * in flight than write buffers).
+ */
+struct live {
+	double taken[WRITE_BUFFERS];
+	int frames;
+	double lat_sum, lat_min, lat_max;
+};
+
+/*
+ * Received packets waiting to be written to disk. They are queued in
+ * buf[head..head+count), modulo WRITE_BUFFERS, and drained by a writer
+ * thread, so that slow disks never delay the ACKs.
+ */
+struct wbuf {
+	struct outfile *out;
+	long offset;
+	int len;		/* 0 marks the end of a frame */
+	unsigned char data[FUJI_PACKET_MAX];
+};
+
+struct writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wbuf buf[WRITE_BUFFERS];
+	int head, count;
+	int error;
+	int stop;
 };
 
-int devfd = -1;
 int desired_speed = -1;
 int list_command_set = 0;
-int maxnum;
-struct termios oldt, newt;
-char has_cmd[256];
-int pictures;
+int ds7_compat = 0, force = 0, picnums = 0, delete_after = 0, info = 0;
+int thumbnails = 0;
+int preview_fmt = PREVIEW_RAW;
+int use_cache = 1;
+int low_latency = 0;
+char *archive_dir = NULL;
+char *tar_path = NULL;
+int ingest_mode = 0;
+PER_LINK int maxnum = 100;
+PER_LINK int maxnum_known, list_complete;
+PER_LINK struct fuji_session *cam;
+PER_LINK int pictures;
 int interrupted = 0;
-int pending_input = 0;
-struct pict_info *pinfo = NULL;
+int live_stop = 0;
+int stats_requested = 0;
+char *stats_file = NULL;
+char *capture_path = NULL;
+PER_LINK struct pict_info *pinfo = NULL;
+
+struct link links[MAX_LINKS];
+int nlinks = 0;
+PER_LINK struct link *cur_link;
+PER_LINK struct writer *writer;
+PER_LINK struct outfile *cur_out;
+struct outfile out_stdout = { 1, 1 };
+mode_t file_mode = 0644;
+int tar_fd = -1;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now (void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void reset_serial (void);
+void out_abort (struct outfile *of);
+int writer_sync (void);
+void writer_stop (void);
+#ifdef __GNUC__
+void die (void) __attribute__ ((noreturn));
+#endif
+
+/*
+ * Fatal error on the current link. With several links, only this
+ * link's thread terminates.
+ */
+void die (void)
+{
+	/* The pictures already received are completed */
+	writer_stop();
+	if (nlinks > 1) {
+		reset_serial();
+		pthread_mutex_lock(&stats_lock);
+		cur_link->status = 1;
+		pthread_mutex_unlock(&stats_lock);
+		pthread_exit(NULL);
+	}
+	exit(1);
+}
+
+/*
+ * An error of the library is fatal for the link. check() passes the
+ * result of a call through, unless it failed.
+ */
+void fail (int err)
+{
+	fprintf(stderr, "%s%s%s\n", (err == FUJI_ERR_INTR) ? "\n" : "",
+		cur_link->tag, cam->error);
+	die();
+}
+
+int check (int ret)
+{
+	if (ret < 0)
+		fail(ret);
+	return ret;
+}
+
+char *check_str (char *s)
+{
+	if (s == NULL)
+		fail(0);
+	return s;
+}
+
+/* Messages of the library (speed negotiation) */
+static void log_message (struct fuji_session *ses, const char *msg)
+{
+	struct link *ln = ses->user;
 
-unsigned char answer[5000];
-int answer_len = 0;
+	fprintf(stderr, "%s%s\n", ln->tag, msg);
+}
 
-static int get_raw_byte (void)
+/*
+ * Create the output file for picture "name" (which may contain a
+ * directory part), and reserve "size" bytes for it. Returns NULL, with
+ * a message, if that's not possible: in particular, a full disk is
+ * detected here, before the transfer.
+ */
+struct outfile *out_create (const char *name, long size)
 {
-	static unsigned char buffer[128];
-	static unsigned char *bufstart;
+	struct outfile *of;
+	struct statvfs vfs;
+	const char *slash;
 	int ret;
 
-	while (!pending_input) {
-		/* Refill the buffer */
-		ret = read(devfd, buffer, 128);
-		if (ret == 0)
-			return -1;  /* timeout */
+	of = calloc(1, sizeof(struct outfile));
+	if (of == NULL) {
+		perror("Cannot allocate output file");
+		return NULL;
+	}
+	of->size = size;
+	slash = strrchr(name, '/');
+	if (slash && slash - name + 1 < sizeof(of->dir)) {
+		memcpy(of->dir, name, slash - name + 1);
+		of->dir[slash - name + 1] = '\0';
+	} else
+		strcpy(of->dir, "./");
+	of->fd = -1;
+#ifdef O_TMPFILE
+	of->fd = open(of->dir, O_TMPFILE|O_RDWR, 0666);
+#endif
+	if (of->fd < 0) {
+		/* No anonymous files on this filesystem */
+		sprintf(of->tmpname, "%s%s", of->dir, TMP_PIC_FILE);
+		of->fd = mkstemp(of->tmpname);
+		if (of->fd >= 0)
+			fchmod(of->fd, file_mode);
+	}
+	if (of->fd < 0) {
+		perror("Cannot create picture file");
+		free(of);
+		return NULL;
+	}
+	ret = -1;
+	errno = EOPNOTSUPP;
+#ifdef __linux__
+	if (size > 0)
+		ret = fallocate(of->fd, 0, 0, size);
+#endif
+	if (ret < 0 && errno != ENOSPC && errno != EDQUOT) {
+		/* Can't preallocate; at least check the free space */
+		if (fstatvfs(of->fd, &vfs) == 0
+		    && (double)vfs.f_bavail * vfs.f_frsize < size)
+			errno = ENOSPC;
+		else
+			ret = 0;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Cannot store %s (%ld bytes): %s\n",
+			name, size, strerror(errno));
+		out_abort(of);
+		return NULL;
+	}
+	return of;
+}
+
+/* Write at the given offset (files) or at the end (streams) */
+int out_write (struct outfile *of, long offset, unsigned char *buf, int len)
+{
+	int ret, n = len;
+
+	if (of->preview != NULL) {
+		if (preview_feed(of->preview, buf, n) < 0)
+			return -1;
+		n = 0;
+	}
+	if (of->mem != NULL) {
+		if (offset < of->size)
+			memcpy(of->mem + offset, buf,
+			       (offset + n > of->size) ? of->size - offset : n);
+		n = 0;
+	}
+	while (n > 0) {
+		if (of->stream)
+			ret = write(of->fd, buf, n);
+		else
+			ret = pwrite(of->fd, buf, n, offset);
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
-			return -1;  /* error */
+			return -1;
 		}
-		pending_input = ret;
-		bufstart = buffer;
+		n -= ret;
+		buf += ret;
+		offset += ret;
 	}
-	pending_input--;
-	return *bufstart++;
+	of->written += len;
+	return len;
 }
 
-int wait_for_input (int seconds)
+/* End of a frame (previews): complete it, and account for it */
+int out_end (struct outfile *of)
 {
-	fd_set rfds;
-	struct timeval tv;
-
-	if (pending_input)
-		return 1;
-	if (!seconds)
-		return 0;
-
-	FD_ZERO(&rfds);
-	FD_SET(devfd, &rfds);
-	tv.tv_sec = seconds;
-	tv.tv_usec = 0;
+	struct live *lv = of->live;
+	double t;
 
-	return select(1+devfd, &rfds, NULL, NULL, &tv);
+	if (of->preview != NULL && preview_end(of->preview) < 0)
+		return -1;
+	if (lv != NULL) {
+		t = now() - lv->taken[lv->frames % WRITE_BUFFERS];
+		lv->lat_sum += t;
+		if (t < lv->lat_min)
+			lv->lat_min = t;
+		if (t > lv->lat_max)
+			lv->lat_max = t;
+		lv->frames++;
+		if (info)
+			fprintf(stderr, "Frame %d: %.0f ms\n", lv->frames, 1000 * t);
+	}
+	return 0;
 }
 
-int get_byte (void)
+void out_abort (struct outfile *of)
 {
-	int c;
-
-	c = get_raw_byte();
-	if (c < 255)
-		return c;
-	c = get_raw_byte();
-	if (c == 255)
-		return c;	/* escaped '\377' */
-	if (c != 0)
-		fprintf(stderr, "get_byte: impossible escape sequence following 0xFF\n");
-	/* Otherwise, it's a parity or framing error */
-	get_raw_byte();
-	return -1;
+	if (of != NULL && of->tar) {
+		free(of->mem);
+		free(of);
+		return;
+	}
+	if (of == NULL || of->stream)
+		return;
+	close(of->fd);
+	if (of->tmpname[0])
+		remove(of->tmpname);
+	free(of);
 }
 
-int put_bytes (int n, unsigned char* buff)
+/*
+ * Tar output: the pictures are written to tar_fd as the members of a
+ * ustar archive, without going through the disk. With one link, the
+ * header is written first (from the announced size) and the packets
+ * follow it as they come. Several links would mix their pictures up:
+ * each picture is then kept in memory, and written out once complete.
+ * Their cameras may use the same names, so that the pictures of each
+ * link go into a directory named after the device ("ttyUSB0/", or
+ * "pts_3/" for /dev/pts/3).
+ */
+#define TAR_BLOCK	512
+
+static int tar_write (const void *buf, long n)
 {
-	int ret;
+	const char *p = buf;
+	long ret;
 
 	while (n > 0) {
-		ret = write(devfd, buff, n);
-		if (ret < 0) {
+		if ((ret = write(tar_fd, p, n)) < 0) {
 			if (errno == EINTR)
 				continue;
 			return -1;
 		}
+		p += ret;
 		n -= ret;
-		buff += ret;
 	}
 	return 0;
 }
 
-int put_byte (int c)
+/* The name of picture "name" in the archive, for the current link */
+static void tar_name (char *member, const char *name)
 {
-	unsigned char buff[1];
-
-	buff[0] = c;
-	return put_bytes(1, buff);
+	const char *dev;
+	char *p;
+
+	if (nlinks > 1) {
+		dev = cur_link->device;
+		if (!strncmp(dev, "/dev/", 5))
+			dev += 5;
+		snprintf(member, 100, "%.70s/%s", dev, name);
+		for (p = strchr(member, '/'); p && strchr(p+1, '/'); p = strchr(p+1, '/'))
+			*p = '_';
+	} else
+		snprintf(member, 100, "%s", name);
 }
 
-int attention (void)
+static int tar_header (const char *member, long size)
 {
+	unsigned char h[TAR_BLOCK];
+	unsigned int sum = 0;
 	int i;
 
-	/* drain input */
-	while (get_byte() >= 0)
-		continue;
-	for (i = 0; i < 3; i++) {
-		put_byte(0x05);
-		if (get_byte() == 0x06)
-			return 0;
-	}
-	fprintf(stderr, "The camera does not respond.\n");
-	exit(1);
+	memset(h, 0, sizeof(h));
+	strncpy((char *) h, member, 100);
+	sprintf((char *) h + 100, "%07o", (unsigned int) file_mode);
+	sprintf((char *) h + 108, "%07o", (unsigned int) getuid() & 07777777);
+	sprintf((char *) h + 116, "%07o", (unsigned int) getgid() & 07777777);
+	sprintf((char *) h + 124, "%011lo", size);
+	sprintf((char *) h + 136, "%011lo", (long) time(NULL));
+	memset(h + 148, ' ', 8);
+	h[156] = '0';
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += h[i];
+	sprintf((char *) h + 148, "%06o", sum);
+	return tar_write(h, TAR_BLOCK);
 }
 
-void send_packet (int len, unsigned char *data, int last)
+/* The output of a picture into the archive, as out_create() */
+struct outfile *tar_create (const char *name, long size)
 {
-	unsigned char *p, *end, buff[3];
-	int check;
+	struct outfile *of;
 
-	last = last ? 0x03 : 0x17;
-	check = last;
-	end = data + len;
-	for (p = data; p < end; p++)
-		check ^= *p;
+	if ((of = calloc(1, sizeof(struct outfile))) == NULL
+	    || (ingest_mode && (of->mem = malloc(size > 0 ? size : 1)) == NULL)) {
+		perror("Cannot allocate output file");
+		free(of);
+		return NULL;
+	}
+	of->fd = tar_fd;
+	of->stream = 1;
+	of->tar = 1;
+	of->size = size;
+	/* Named now: the writer thread may write the header */
+	tar_name(of->member, name);
+	/* The header goes straight out: the previous member must be complete */
+	if (!ingest_mode)
+		writer_sync();
+	if (!ingest_mode && tar_header(of->member, size) < 0) {
+		perror("Cannot write the archive");
+		out_abort(of);
+		return NULL;
+	}
+	return of;
+}
 
-	/* Start of frame */
-	buff[0] = 0x10;
-	buff[1] = 0x02;
-	put_bytes(2, buff);
+/* The output of a picture: a file, or a member of the archive */
+struct outfile *pic_create (const char *name, long size)
+{
+	return (tar_fd >= 0) ? tar_create(name, size) : out_create(name, size);
+}
 
-	/* Data */
-	for (p = data; p < end; p++)
-		if (*p == 0x10) {
-			/* Send everything between "data" and "p" (included) */
-			put_bytes(p-data+1, data);
-			/* And make sure the last byte (0x10) will be sent again */
-			data = p;
-		}
-	put_bytes(end-data, data);
+/* Complete the member, as out_commit() */
+static int tar_commit (struct outfile *of)
+{
+	static const unsigned char zeros[TAR_BLOCK];
+	int ret = 0, error;
+
+	if (of->mem != NULL)
+		ret = tar_header(of->member, of->size) < 0
+			|| tar_write(of->mem, of->size) < 0;
+	if (!ret && of->size % TAR_BLOCK)
+		ret = tar_write(zeros, TAR_BLOCK - of->size % TAR_BLOCK) < 0;
+	error = errno;
+	out_abort(of);
+	errno = error;
+	return ret ? -1 : 0;
+}
 
-	/* End of frame */
-	buff[1] = last;
-	buff[2] = check;
-	put_bytes(3, buff);
+/* The end of the archive: two empty blocks */
+int tar_finish (void)
+{
+	static const unsigned char zeros[2*TAR_BLOCK];
+
+	if (tar_write(zeros, sizeof(zeros)) < 0 || close(tar_fd) < 0) {
+		perror("Cannot write the archive");
+		return -1;
+	}
+	return 0;
 }
 
-int read_packet (void)
+/*
+ * Give the complete file its name. Unless "overwrite" is set, an
+ * existing file is never replaced (another link may have brought a
+ * picture with the same name in the meantime). Returns 0 on success,
+ * or -1 with errno set; the output file is released in any case.
+ */
+int out_commit (struct outfile *of, const char *name, int overwrite)
 {
-	unsigned char *p = answer;
-	int c, check, incomplete;
+	char path[64], tmpname[300];
+	int ret, fd;
 
-	if (get_byte() != 0x10 || get_byte() != 0x02) {
-bad_frame:
-		/* drain input */
-		while (get_byte() >= 0)
-			continue;
+	if (of->written != of->size) {
+		errno = EIO;
+		out_abort(of);
 		return -1;
 	}
-	check = 0;
-	while(1) {
-		if ((c = get_byte()) < 0)
-			goto bad_frame;
-		if (c == 0x10) {
-			if ((c = get_byte()) < 0)
-				goto bad_frame;
-			if (c == 0x03 || c == 0x17) {
-				incomplete = (c == 0x17);
-				break;
+	if (of->tar)
+		return tar_commit(of);
+	if (of->tmpname[0]) {
+		ret = overwrite ? rename(of->tmpname, name) : link(of->tmpname, name);
+	} else {
+		sprintf(path, "/proc/self/fd/%d", of->fd);
+		ret = linkat(AT_FDCWD, path, AT_FDCWD, name, AT_SYMLINK_FOLLOW);
+		if (ret < 0 && errno == EEXIST && overwrite) {
+			/* Link it under a temporary name, then rename */
+			sprintf(tmpname, "%s%s", of->dir, TMP_PIC_FILE);
+			fd = mkstemp(tmpname);
+			if (fd >= 0) {
+				close(fd);
+				remove(tmpname);
+				ret = linkat(AT_FDCWD, path, AT_FDCWD, tmpname, AT_SYMLINK_FOLLOW);
+				if (ret == 0 && (ret = rename(tmpname, name)) < 0)
+					remove(tmpname);
 			}
 		}
-		*p++ = c;
-		check ^= c;
-	}
-	/* Append a sentry '\0' at the end of the buffer, for the convenience
-	   of C programmers */
-	*p = '\0';
-	answer_len = p - answer;
-	check ^= c;
-	c = get_byte();
-	if (c != check)
-		return -1;
-	if (answer[2] + (answer[3]<<8) != answer_len - 4)
-		return -1;
-	/* Return 0 for the last packet, 1 otherwise */
-	return incomplete;
-}
-
-int cmd (int len, unsigned char *data, FILE *fd)
-{
-	int c, retry;
-	int timeout = 1;
-
-	/* Some commands require larger timeouts */
-	switch (data[1]) {
-	  case 0x27:	/* Take picture */
-	  case 0x34:	/* Recharge the flash */
-	  case 0x64:	/* Take preview */
-	    timeout = 12;
-	    break;
-	  case 0x0b:	/* Count pictures */
-	  case 0x19:    /* Erase a picture */
-	    timeout = 2;
-	    break;
-	}
-
-	retry = 0;
-send_cmd:
-	send_packet(len, data, 1);
-	wait_for_input(timeout);
-wait_ack:
-	c = get_byte();
-	if (c == 0x06)
-		goto send_ok;
-	if (++retry == 3) {
-		fprintf(stderr,
-		  "Cannot issue command %02x, aborting.\n", data[1]);
-		exit(1);
 	}
-	if (c == 0x15)
-		goto send_cmd;
-	/* Garbled answer? Throw it away and ask for resend */
-	while (get_byte() >= 0)
-		continue;
-	put_byte(0x15);
-	goto wait_ack;
-
-send_ok:
-	retry = 0;
-	wait_for_input(timeout);
-	do {
-	  c = read_packet();
-	  if (c < 0) {
-	    if (++retry == 3) {
-		fprintf(stderr,
-		  "Cannot receive answer (cmd=%02x), aborting.\n", data[1]);
-		exit(1);
-	    }
-	    put_byte(0x15);
-	    continue;
-	  }
-	  if (c && interrupted) {
-	    /* Not the last packet */
-	    fprintf(stderr, "\nInterrupted!\n");
-	    exit(1);
-	  }
-	  put_byte(0x06);
-	  if (fd != NULL)
-	    fwrite(answer+4, 1, answer_len-4, fd);
-	} while(c);
-
-	/* Success */
-	return 0;
+	fd = errno;
+	out_abort(of);
+	errno = fd;
+	return ret;
 }
 
-int cmd0 (int c0, int c1, FILE *fd)
+static void *writer_thread (void *arg)
 {
-	unsigned char b[4];
+	struct writer *w = arg;
+	struct wbuf *wb;
+	int n;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (w->count == 0 && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->count == 0)
+			break;
+		wb = &w->buf[w->head];
+		pthread_mutex_unlock(&w->lock);
+		if (wb->len == 0)
+			n = out_end(wb->out);
+		else
+			n = out_write(wb->out, wb->offset, wb->data, wb->len);
+		if (n < 0 && !wb->out->error)
+			wb->out->error = errno ? errno : EIO;
+		if (n < 0 && !w->error)
+			w->error = errno ? errno : EIO;
+		/* It may release the file */
+		if (wb->len == 0 && wb->out->done != NULL)
+			wb->out->done(wb->out);
+		pthread_mutex_lock(&w->lock);
+		w->head = (w->head + 1) % WRITE_BUFFERS;
+		w->count--;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
 
-	b[0] = c0; b[1] = c1;
-	b[2] = b[3] = 0;
-	return cmd(4, b, fd);
+/*
+ * Get the next free buffer, waiting only if all of them are queued.
+ * The writer thread is started on first use.
+ */
+struct wbuf *writer_get (void)
+{
+	struct writer *w = writer;
+	struct wbuf *wb;
+	long long t0;
+
+	if (w == NULL) {
+		w = calloc(1, sizeof(struct writer));
+		if (w == NULL) {
+			perror("Cannot allocate write buffers");
+			die();
+		}
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+			perror("pthread_create");
+			die();
+		}
+		writer = w;
+	}
+	pthread_mutex_lock(&w->lock);
+	if (w->count == WRITE_BUFFERS) {
+		t0 = stats_usec();
+		while (w->count == WRITE_BUFFERS)
+			pthread_cond_wait(&w->cond, &w->lock);
+		cam->stats.writer_us += stats_usec() - t0;
+	}
+	wb = &w->buf[(w->head + w->count) % WRITE_BUFFERS];
+	pthread_mutex_unlock(&w->lock);
+	return wb;
 }
 
-int cmd1 (int c0, int c1, int arg, FILE *fd)
+/* Queue the buffer returned by the last writer_get() */
+void writer_put (void)
 {
-	unsigned char b[5];
+	struct writer *w = writer;
 
-	b[0] = c0; b[1] = c1;
-	b[2] =  1; b[3] =  0;
-	b[4] = arg;
-	return cmd(5, b, fd);
+	pthread_mutex_lock(&w->lock);
+	w->count++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
 }
 
-int cmd2 (int c0, int c1, int arg, FILE *fd)
+/* Queue the end of the current frame of "out" */
+void writer_end (struct outfile *out)
 {
-	unsigned char b[6];
+	struct wbuf *wb = writer_get();
 
-	b[0] = c0; b[1] = c1;
-	b[2] =  2; b[3] =  0;
-	b[4] = arg; b[5] = arg>>8;
-	return cmd(6, b, fd);
+	wb->out = out;
+	wb->len = 0;
+	writer_put();
 }
 
-char* dc_version_info (void)
+/* The errno value of the first failed write so far, or 0 */
+int writer_error (void)
 {
-	cmd0 (0, 0x09, 0);
-	return answer+4;
+	struct writer *w = writer;
+	int error;
+
+	if (w == NULL)
+		return 0;
+	pthread_mutex_lock(&w->lock);
+	error = w->error;
+	pthread_mutex_unlock(&w->lock);
+	return error;
 }
 
-char* dc_camera_type (void)
+/*
+ * Wait until everything has been written. Returns 0, or the errno
+ * value of the first failed write since the last call.
+ */
+int writer_sync (void)
 {
-	cmd0 (0, 0x29, 0);
-	return answer+4;
+	struct writer *w = writer;
+	long long t0 = stats_usec();
+	int error;
+
+	if (w == NULL)
+		return 0;
+	pthread_mutex_lock(&w->lock);
+	while (w->count)
+		pthread_cond_wait(&w->cond, &w->lock);
+	cam->stats.writer_us += stats_usec() - t0;
+	error = w->error;
+	w->error = 0;
+	pthread_mutex_unlock(&w->lock);
+	return error;
 }
 
-char* dc_camera_id (void)
+void writer_stop (void)
 {
-	cmd0 (0, 0x80, 0);
-	return answer+4;
+	struct writer *w = writer;
+
+	if (w == NULL)
+		return;
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	free(w);
+	writer = NULL;
 }
 
-int dc_set_camera_id (const char *id)
+/*
+ * Write the statistics of all the links into the file given with "-S"
+ * ("-" is standard error), as JSON. Called at exit, and after SIGUSR1.
+ */
+void write_stats (void)
 {
-	unsigned char b[14];
-	int n = strlen(id);
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	char tmpname[1100];
+	FILE *fd;
+	int i;
 
-	if (n > 10)
-		n = 10;
-	b[0] = 0;
-	b[1] = 0x82;
-	b[2] = n;
-	b[3] = 0;
-	memcpy(b+4, id, n);
-	return cmd(n+4, b, 0);
+	stats_requested = 0;
+	if (stats_file == NULL)
+		return;
+	pthread_mutex_lock(&lock);
+	if (!strcmp(stats_file, "-"))
+		fd = stderr;
+	else {
+		snprintf(tmpname, sizeof(tmpname), "%s.tmp", stats_file);
+		fd = fopen(tmpname, "w");
+	}
+	if (fd == NULL) {
+		fprintf(stderr, "Cannot write statistics to %s: %s\n",
+			stats_file, strerror(errno));
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	fprintf(fd, "{\"links\": [\n");
+	for (i = 0; i < nlinks; i++) {
+		stats_json(fd, links[i].device, &links[i].ses->stats);
+		fprintf(fd, "%s\n", (i < nlinks-1) ? "," : "");
+	}
+	fprintf(fd, "]}\n");
+	if (fd != stderr && (fclose(fd) != 0 || rename(tmpname, stats_file) < 0))
+		fprintf(stderr, "Cannot write statistics to %s: %s\n",
+			stats_file, strerror(errno));
+	pthread_mutex_unlock(&lock);
 }
 
-char* dc_get_date (void)
+/*
+ * The sink of the transfers into an output file: the packets are queued
+ * for the writer thread (call writer_sync() before using the file).
+ */
+static int sink_write (void *arg, long offset, const unsigned char *data, int len)
 {
-	char *fmtdate = answer+50;
-	
-	cmd0 (0, 0x84, 0);
-	strcpy(fmtdate, "YYYY/MM/DD HH:MM:SS");
-	memcpy(fmtdate,    answer+4,   4);	/* year */
-	memcpy(fmtdate+5,  answer+8,   2);	/* month */
-	memcpy(fmtdate+8,  answer+10,  2);	/* day */
-	memcpy(fmtdate+11, answer+12,  2);	/* hour */
-	memcpy(fmtdate+14, answer+14,  2);	/* minutes */
-	memcpy(fmtdate+17, answer+16,  2);	/* seconds */
-
-	return fmtdate;
+	struct wbuf *wb = writer_get();
+
+	if (stats_requested)
+		write_stats();
+	wb->out = arg;
+	wb->offset = offset;
+	wb->len = len;
+	memcpy(wb->data, data, len);
+	writer_put();
+	return 0;
 }
 
-int dc_set_date (const char *date)
+void list_commands (void)
 {
-	unsigned char b[18];
-	int n = strlen(date);
+	int c, n = 0;
 
-	if (n > 14)
-		n = 14;
-	b[0] = 0;
-	b[1] = 0x86;
-	b[2] = n;
-	b[3] = 0;
-	memcpy(b+4, date, n);
-	return cmd(n+4, b, 0);
+	fprintf(stderr, "%sSupported commands:", cur_link->tag);
+	for (c = 0; c < 256; c++)
+		if (cam->has_cmd[c])
+			fprintf(stderr, "%s%02x", (n++ % 16 == 0) ? "\n\t" : " ", c);
+	fprintf(stderr, "\n");
 }
 
-int dc_get_flash_mode (void)
+/*
+ * Name of a cache file in ~/.fujiplay: "kind-key", where unusual
+ * characters of the key are replaced by underscores. Returns NULL if
+ * there's no home directory.
+ */
+char *cache_file (const char *kind, const char *key)
 {
-	cmd0 (0, 0x30, 0);
-	return answer[4];
+	static PER_LINK char path[512];
+	char *home = getenv("HOME"), *p;
+	int n;
+
+	if (home == NULL || strlen(home) > 256)
+		return NULL;
+	sprintf(path, "%s/%s", home, CACHE_DIR);
+	mkdir(path, 0755);
+	n = strlen(path);
+	sprintf(path+n, "/%s-%.64s", kind, key);
+	for (p = path+n+strlen(kind)+2; *p; p++)
+		if (!strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			    "0123456789.-", *p))
+			*p = '_';
+	return path;
 }
 
-int dc_set_flash_mode (int mode)
+/*
+ * Write a cache file atomically, via a temporary file. "emit" is called
+ * to write the contents.
+ */
+void save_cache_file (const char *path, void (*emit)(FILE *, void *), void *arg)
 {
-	cmd1 (0, 0x32, mode, 0);
-	return answer[4];
+	char tmp[530];
+	FILE *fd;
+	int tfd;
+
+	if (path == NULL)
+		return;
+	/* Unique, as several links may save at the same time */
+	sprintf(tmp, "%s.XXXXXX", path);
+	if ((tfd = mkstemp(tmp)) < 0)
+		return;
+	fchmod(tfd, file_mode);
+	if ((fd = fdopen(tfd, "w")) == NULL) {
+		close(tfd);
+		remove(tmp);
+		return;
+	}
+	emit(fd, arg);
+	if (fclose(fd) != 0 || rename(tmp, path) < 0)
+		remove(tmp);
 }
 
-int dc_nb_pictures (void)
+/*
+ * The catalog cache remembers the names and sizes of the pictures of a
+ * camera, identified by its ID. It's valid as long as the number of
+ * pictures, the name of the latest picture and the sizes of the first
+ * and last known ones are the same. If pictures were added (and the
+ * last known one is still in place) only the new frames have to be
+ * enumerated.
+ */
+struct catalog_key {
+	char id[16];
+	char latest[64];
+};
+
+static void emit_catalog (FILE *fd, void *arg)
 {
-	cmd0 (0, 0x0b, 0);
-	return answer[4] + (answer[5]<<8);
+	struct catalog_key *key = arg;
+	int i;
+
+	fprintf(fd, "fujiplay catalog 1\n%d %s\n", pictures, key->latest);
+	for (i = 1; i <= pictures; i++)
+		fprintf(fd, "%s %d\n", pinfo[i].name, pinfo[i].size);
 }
 
-char *dc_picture_name (int i)
+/* Fill pinfo[] from the cache. Returns the number of known frames. */
+int load_catalog (struct catalog_key *key)
 {
-	cmd2 (0, 0x0a, i, 0);
-	return answer+4;
+	char *path, line[128], name[64];
+	int count, i, size;
+	FILE *fd;
+
+	if ((path = cache_file("catalog", key->id)) == NULL)
+		return 0;
+	if ((fd = fopen(path, "r")) == NULL)
+		return 0;
+	if (fgets(line, sizeof(line), fd) == NULL
+	    || strcmp(line, "fujiplay catalog 1\n")
+	    || fscanf(fd, "%d %63s", &count, name) != 2
+	    || count > pictures || count <= 0
+	    || (count == pictures && strcmp(name, key->latest))) {
+		fclose(fd);
+		return 0;
+	}
+	for (i = 1; i <= count; i++) {
+		if (fscanf(fd, "%63s %d", name, &size) != 2)
+			break;
+		free(pinfo[i].name);
+		pinfo[i].name = strdup(name);
+		pinfo[i].size = size;
+	}
+	fclose(fd);
+	/*
+	 * Pictures were added: is the last known one still there? Another
+	 * camera with the same ID would have other sizes: check two.
+	 */
+	if (i <= count || (count < pictures
+	    && strcmp(check_str(dc_picture_name(cam, count)), pinfo[count].name))
+	    || check(dc_picture_size(cam, count)) != pinfo[count].size
+	    || check(dc_picture_size(cam, 1)) != pinfo[1].size) {
+		while (--i > 0) {
+			free(pinfo[i].name);
+			pinfo[i].name = NULL;
+		}
+		return 0;
+	}
+	return count;
 }
 
-int dc_picture_size (int i)
+void free_picture_list (void)
 {
-	cmd2 (0, 0x17, i, 0);
-	return answer[4] + (answer[5] << 8) + (answer[6] << 16) + (answer[7] << 24);
+	int i;
+
+	if (pinfo == NULL)
+		return;
+	for (i = 1; i <= pictures; i++)
+		free(pinfo[i].name);
+	free(pinfo);
+	pinfo = NULL;
 }
 
-int charge_flash (int amount)
+/*
+ * Get the number of pictures. Their names and sizes are only fetched
+ * when needed, by pict() or get_picture_list().
+ */
+void get_picture_count (void)
 {
-	cmd2 (0, 0x34, amount, 0);
-	return answer[4];
+	free_picture_list();
+	pictures = check(dc_nb_pictures(cam));
+	maxnum = 100;
+	maxnum_known = list_complete = 0;
+	pinfo = calloc(pictures+1, sizeof(struct pict_info));
+	if (archive_dir && !cur_link->id[0])
+		strcpy(cur_link->id, cam->has_cmd[0x80] ? check_str(fuji_camera_key(cam)) : "-");
+	if (info)
+		fprintf(stderr, "%s%d pictures on the camera.\n", cur_link->tag, pictures);
 }
 
-int take_picture (void)
+static void set_pict_info (struct pict_info *pi)
 {
-	cmd0 (0, 0x27, 0);
-	return answer[4] + (answer[5] << 8) + (answer[6] << 16) + (answer[7] << 24);
+	struct stat st;
+	int n_off;
+
+	/*
+	 * To find the picture number, go to the first digit. According to
+	 * recent Exif specs, n_off can be either 3 or 4.
+	 */
+	n_off = strcspn(pi->name, "0123456789");
+	if ((pi->number = atoi(pi->name+n_off)) > maxnum)
+		maxnum = pi->number;
+	/* With an archive, it's looked up in the index rather than here */
+	if (archive_dir)
+		pi->ondisk = archive_has(cur_link->id, pi->name, pi->size);
+	else
+		pi->ondisk = (tar_fd < 0 && !stat(pi->name, &st));
 }
 
-int del_frame (int i)
+/*
+ * The session cache, ~/.fujiplay/session-DEVICE, keeps the profile of
+ * the camera (see libfujiplay.h), which saves the speed probing and the
+ * command list query on the next connection to the same camera.
+ */
+void load_session (const char *device, struct fuji_profile *pr)
 {
-	cmd2 (0, 0x19, i, 0);
-	return answer[4];
+	char *path, line[64];
+	int c, t;
+	FILE *fd;
+
+	memset(pr, 0, sizeof(*pr));
+	memset(pr->info, 0xff, sizeof(pr->info));
+	if (!use_cache || (path = cache_file("session", device)) == NULL)
+		return;
+	if ((fd = fopen(path, "r")) == NULL)
+		return;
+	if (fgets(line, sizeof(line), fd) == NULL
+	    || strcmp(line, "fujiplay session 1\n")
+	    || fscanf(fd, "%d %15s", &pr->speed, pr->id) != 2) {
+		fclose(fd);
+		pr->speed = 0;
+		return;
+	}
+	if (!strcmp(pr->id, "-"))
+		pr->id[0] = '\0';
+	while (fscanf(fd, "%x", &c) == 1)
+		if (c >= 0 && c < 256) {
+			pr->cmds[c] = 1;
+			if (fscanf(fd, ":%d", &t) == 1)
+				pr->info[c] = t;
+		}
+	fclose(fd);
 }
 
-void get_command_list (int ds7_compat)
+static void emit_session (FILE *fd, void *arg)
 {
-	int i;
+	struct fuji_profile *pr = arg;
+	int c, n = 0;
 
-	memset(has_cmd, 0, 256);
-	if (ds7_compat) {
-		/*
-		 * The DS-7 doesn't have the 4C command to query capabilities;
-		 * therefore, we assume a very minimal command set.
-		 */
-#if 0
-		/*
-		 * If you are daring, uncomment these lines; what follows
-		 * is what I conjecture to be the actual capability set.
-		 * Read mx700-commands.html for details. I'd like to have
-		 * your feedback about this.
-		 */
-		static unsigned char ds7_cmds[] = {
-			0x00, 0x02, 0x07, 0x09, 0x0a, 0x0b, 0x0c, 0x0e,
-			0x0f, 0x11, 0x13, 0x15, 0x17, 0x19, 0x1b, 0x27,
-			0x29, 0x30, 0x32, 0x34 };
-		for (i = 0; i < sizeof(ds7_cmds); i++)
-			has_cmd[ds7_cmds[i]] = 1;
-#endif
-		return;
+	fprintf(fd, "fujiplay session 1\n%d %s\n", pr->speed,
+		pr->id[0] ? pr->id : "-");
+	for (c = 0; c < 256; c++) {
+		if (!pr->cmds[c])
+			continue;
+		fprintf(fd, "%02x", c);
+		if (pr->info[c] >= 0)
+			fprintf(fd, ":%d", pr->info[c]);
+		fputc((++n % 16) ? ' ' : '\n', fd);
 	}
-	cmd0 (0, 0x4c, 0);
-	for (i = 4; i < answer_len; i++)
-		has_cmd[answer[i]] = 1;
-	if (list_command_set) {
-		fprintf(stderr, "Supported commands:");
-		for (i = 4; i < answer_len; i++)
-			fprintf(stderr, "%s%02x", (i%16==4 ? "\n\t" : " "), answer[i]);
-		fprintf(stderr, "\n");
+	fprintf(fd, "\n");
+}
+
+void save_session (const char *device, struct fuji_profile *pr)
+{
+	if (use_cache && pr->changed)
+		save_cache_file(cache_file("session", device), emit_session, pr);
+}
+
+/* Information about frame i, fetched from the camera if needed */
+struct pict_info *pict (int i)
+{
+	struct pict_info *pi = &pinfo[i];
+
+	if (pi->name == NULL) {
+		pi->name = strdup(check_str(dc_picture_name(cam, i)));
+		pi->size = check(dc_picture_size(cam, i));
+		set_pict_info(pi);
 	}
+	return pi;
 }
 
-void get_picture_list (void)
+/*
+ * Get the names and sizes of the pictures not known yet, after
+ * get_picture_count().
+ */
+void complete_picture_list (void)
 {
-	int i, n_off;
-	char *name;
-	struct stat st;
+	struct catalog_key key;
+	int i, known = 0, cached;
 
-	pictures = dc_nb_pictures();
-	maxnum = 100;
-	free(pinfo);
-	pinfo = calloc(pictures+1, sizeof(struct pict_info));
-	for (i = 1; i <= pictures; i++) {
-		name = strdup(dc_picture_name(i));
-		pinfo[i].name = name;
-		/*
-		 * To find the picture number, go to the first digit. According to
-		 * recent Exif specs, n_off can be either 3 or 4.
-		 */
-		n_off = strcspn(name, "0123456789");
-		if ((pinfo[i].number = atoi(name+n_off)) > maxnum)
-			maxnum = pinfo[i].number;
-		pinfo[i].size = dc_picture_size(i);
-		pinfo[i].ondisk = !stat(name, &st);
+	if (info)
+		fprintf(stderr, "%sGetting picture list...\n", cur_link->tag);
+	cached = (use_cache && pictures > 0 && cam->has_cmd[0x80] && cam->has_cmd[0x15]);
+	if (cached) {
+		strcpy(key.id, check_str(fuji_camera_key(cam)));
+		sprintf(key.latest, "%.63s", check_str(dc_latest_picture(cam)));
+		known = load_catalog(&key);
+		if (info)
+			fprintf(stderr, "%s%d of %d pictures found in the catalog cache\n",
+				cur_link->tag, known, pictures);
 	}
+	for (i = 1; i <= known; i++)
+		set_pict_info(&pinfo[i]);
+	for (i = known+1; i <= pictures; i++)
+		pict(i);
+	maxnum_known = list_complete = 1;
+	if (cached && known < pictures)
+		save_cache_file(cache_file("catalog", key.id), emit_catalog, &key);
+}
+
+void get_picture_list (void)
+{
+	get_picture_count();
+	complete_picture_list();
 }
 
 void list_pictures (void)
@@ -529,234 +1068,747 @@ void list_pictures (void)
 	for (i = 1; i <= pictures; i++) {
 		pi = &pinfo[i];
 		ex = pi->ondisk ? '*' : ' ';
-		printf("%3d%c  %12s  %7d\n", i, ex, pi->name, pi->size);
+		printf("%s%3d%c  %12s  %7d\n", cur_link->tag, i, ex, pi->name, pi->size);
 	}
 }
 
-void close_connection (void)
+/*
+ * Record the traffic of the link into the file given with "-W" (with
+ * several devices, the base name of each one is appended to it).
+ */
+void start_capture (struct link *ln)
 {
-	put_byte(0x04);
-	tcdrain(devfd);
-	usleep(50000);
+	char path[1100];
+	char *base;
+
+	if (nlinks > 1) {
+		base = strrchr(ln->device, '/');
+		snprintf(path, sizeof(path), "%s.%s", capture_path,
+			 base ? base+1 : ln->device);
+	} else
+		snprintf(path, sizeof(path), "%s", capture_path);
+	if ((cam->capture = capture_create(path)) == NULL) {
+		fprintf(stderr, "Cannot create capture file %s: %s\n",
+			path, strerror(errno));
+		die();
+	}
 }
 
 void reset_serial (void)
 {
-	if (devfd >= 0) {
-		close_connection();
-		tcsetattr(devfd, TCSANOW, &oldt);
-		remove(TMP_PIC_FILE);
+	if (cam == NULL)
+		return;
+	if (cam->fd >= 0) {
+		save_session(cur_link->device, &cam->profile);
+		fuji_close(cam);
+		out_abort(cur_out);
+		cur_out = NULL;
+	}
+	if (cam->capture) {
+		if (capture_close(cam->capture) != 0)
+			perror("Cannot write capture file");
+		cam->capture = NULL;
 	}
-	devfd = -1;
 }
 
-void init_serial (const char *devname)
+/* Connect to the camera, at the best speed, and get its command set */
+void init_serial (struct link *ln)
 {
-	devfd = open(devname, O_RDWR|O_NOCTTY);
-	if (devfd < 0) {
-		perror("Cannot open device");
-		exit(1);
-	}
-	if (tcgetattr(devfd, &oldt) < 0) {
-		perror("tcgetattr");
-		exit(1);
+	cam = ln->ses;
+	cam->user = ln;
+	cam->verbose = info;
+	cam->low_latency = low_latency;
+	cam->interrupted = &interrupted;
+	cam->log = log_message;
+	if (capture_path)
+		start_capture(ln);
+	atexit(reset_serial);
+	load_session(ln->device, &cam->profile);
+	check(fuji_open(cam, ln->device));
+	if (info)
+	{
+		fprintf(stderr, "Connection established.\n");
+		fprintf(stderr, "Set baudrate...\n");
 	}
-	newt = oldt;
-	newt.c_iflag |= (PARMRK|INPCK);
-	newt.c_iflag &= ~(BRKINT|IGNBRK|IGNPAR|ISTRIP|INLCR|IGNCR|ICRNL|IXON|IXOFF);
-	newt.c_oflag &= ~(OPOST);
-	newt.c_cflag |= (CLOCAL|CREAD|CS8|PARENB);
-	newt.c_cflag &= ~(CSTOPB|HUPCL|PARODD);
-	newt.c_lflag &= ~(ECHO|ECHOE|ECHOK|ECHONL|ICANON|ISIG|NOFLSH|TOSTOP);
-	newt.c_cc[VMIN] = 0;
-	newt.c_cc[VTIME] = 1;
-	cfsetispeed(&newt, B9600);
-	cfsetispeed(&newt, B9600);
-	if (tcsetattr(devfd, TCSANOW, &newt) < 0) {
-		perror("tcsetattr");
-		exit(1);
+	check(fuji_set_speed(cam, desired_speed));
+	if (info)
+	{
+		fprintf(stderr, "Getting command list...\n");
 	}
-	atexit(reset_serial);
-	attention();
+	check(fuji_get_commands(cam, ds7_compat, list_command_set));
+	if (list_command_set)
+		list_commands();
 }
 
-void set_baudrate (int info)
+/*
+ * The transfer of picture "n" of link "ln" into "out" is over, and
+ * written (it took from "t1" to "t2" in clock ticks, and began at "t0"):
+ * check it, give it its name and account for it. Returns 0, 1 if the
+ * picture was already there, or -1 on error; "out" is released in any
+ * case. Called by the writer thread.
+ */
+int finish_picture (struct link *ln, struct outfile *out, int n, const char *name,
+		    int size, double t0, clock_t t1, clock_t t2)
 {
-	struct baudrate_info *bi;
 	int error;
-	int debug = info;
 
-	for (bi = brinfo; bi->number; bi++) {
-		/* Speed autodetection or not ? */
-		if (desired_speed > 0 && desired_speed != bi->speed)
-			continue;
-		if (debug)
-			fprintf(stderr, "set_baudrate: trying %6d bps... ", bi->speed);
-		cmd1(1, 7, bi->number, 0);
-		error = answer[4];
-		if (debug) {
-			if (error) fprintf(stderr, "not ");
-			fprintf(stderr, "supported\n");
-		}
-		if (error)
-			continue;
-		/* This speed should be supported. Let's see. */
-		close_connection();
-		cfsetispeed(&newt, bi->posix_speed);
-		cfsetospeed(&newt, bi->posix_speed);
-		tcsetattr(devfd, TCSANOW, &newt);
-		attention();
-		if (debug)
-			fprintf(stderr, "set_baudrate: new speed is %d bps\n", bi->speed);
-		return;
+	if ((error = out->error) != 0) {
+		fprintf(stderr, "Cannot write picture file: %s\n", strerror(error));
+		out_abort(out);
+		return -1;
+	}
+	if (t1==t2) t2++; /* paranoia */
+	printf("%s%3d   %12s  ", ln->tag, n, name);
+	printf("%3d seconds, ", (int)(t2-t1) / CLK_TCK);
+	printf("%4d bytes/s\n", size * CLK_TCK / (int)(t2-t1));
+	if (out->written != size) {
+		/* Truncated file */
+		fprintf(stderr, "Short picture file (%ld bytes instead of %d)\n",
+			out->written, size);
+		out_abort(out);
+		return -1;
+	}
+	if (out_commit(out, name, force) < 0) {
+		if (errno == EEXIST) {
+			fprintf(stderr, "%s%s already exists, not overwritten\n",
+				ln->tag, name);
+			return 1;
+		}
+		perror("Cannot rename file");
+		return -1;
+	}
+	pthread_mutex_lock(&stats_lock);
+	ln->pictures++;
+	ln->bytes += size;
+	ln->seconds += now() - t0;
+	pthread_mutex_unlock(&stats_lock);
+	return 0;
+}
+
+/* In the writer thread: the picture is written */
+static void picture_written (struct outfile *out)
+{
+	struct commit *c = out->arg;
+	struct pict_info *pi = c->pi;
+	int ret;
+
+	ret = finish_picture(c->link, out, c->n, pi->name, pi->size, c->t0, c->t1, c->t2);
+	if (ret == 0)
+		verify_submit(pi->name, c->link->tag,
+			      archive_dir ? c->link->id : NULL, &pi->verified);
+	pthread_mutex_lock(&stats_lock);
+	pi->transferred = (ret == 0);
+	if (ret < 0)
+		c->link->commit_error = 1;
+	pthread_mutex_unlock(&stats_lock);
+	free(c);
+}
+
+/*
+ * The transfer of picture "n" into "out" is over: the writer thread
+ * completes it once its packets are written, and the next one can be
+ * transferred meanwhile.
+ */
+void commit_picture (struct outfile *out, int n, double t0, clock_t t1)
+{
+	struct commit *c;
+	struct tms stms;
+
+	if ((c = malloc(sizeof(struct commit))) == NULL) {
+		perror("Cannot commit picture");
+		die();
 	}
-	fprintf(stderr, "set_baudrate: still at 9600 bps\n");
+	c->link = cur_link;
+	c->pi = &pinfo[n];
+	c->n = n;
+	c->t0 = t0;
+	c->t1 = t1;
+	c->t2 = times(&stms);
+	out->done = picture_written;
+	out->arg = c;
+	cur_out = NULL;
+	writer_end(out);
+}
+
+/*
+ * A picture the writer thread failed to complete is fatal; with "wait",
+ * once all of them are.
+ */
+void check_commits (int wait)
+{
+	int error;
+
+	if (wait)
+		writer_sync();
+	pthread_mutex_lock(&stats_lock);
+	error = cur_link->commit_error;
+	pthread_mutex_unlock(&stats_lock);
+	if (error)
+		die();
+}
+
+/*
+ * With "-d", pictures are deleted while the others are downloaded: the
+ * frame numbers above a deleted picture go down by one.
+ */
+int camera_frame (int n)
+{
+	int i, frame = n;
+
+	for (i = 1; i < n; i++)
+		frame -= (pinfo[i].deleted == 1);
+	return frame;
 }
 
 void download_picture(int n)
 {
-	FILE *fd;
+	struct outfile *out;
+	struct fuji_sink sink;
 	char *name = pinfo[n].name;
 	int size = pinfo[n].size;
-	struct stat st;
 	struct tms stms;
-	clock_t t1, t2;
-
-	printf("%3d   %12s  ", n, name); fflush(stdout);
-	fd = fopen(TMP_PIC_FILE, "w");
-	if (fd == NULL) {
-		perror("Cannot create picture file");
-		exit(1);
-	}
+	clock_t t1;
+	double t0;
+
+	check_commits(0);
+	if ((out = pic_create(name, size)) == NULL)
+		die();
+	cur_out = out;
+	sink.write = sink_write;
+	sink.arg = out;
+	t0 = now();
 	t1 = times(&stms);
-	cmd2(0, 0x02, n, fd);
-	t2 = times(&stms);
-	if (t1==t2) t2++; /* paranoia */
-	printf("%3d seconds, ", (int)(t2-t1) / CLK_TCK);
-	printf("%4d bytes/s\n", size * CLK_TCK / (int)(t2-t1));
-	fclose(fd);
-	if (stat(TMP_PIC_FILE, &st) < 0 || st.st_size != size) {
-		/* Truncated file */
-		fprintf(stderr, "Short picture file -- disk full or quota exceeded\n");
-		exit(1);
-	}
-	if (rename(TMP_PIC_FILE, name) < 0) {
-		perror("Cannot rename file");
-		exit(1);
-	}
-	pinfo[n].transferred = 1;
+	check(dc_get_picture(cam, camera_frame(n), &sink));
+	commit_picture(out, n, t0, t1);
 }
 
-void download_range (int start, int end, int picnums, int force)
+/*
+ * Apply "action" to the pictures between "start" and "end". With frame
+ * numbers, only the frames in the range are looked at; picture numbers
+ * can't be located without the whole list.
+ */
+void picture_range (int start, int end, int picnums, void (*action)(int))
 {
-	int i, num;
+	int i, num, first = 1, last = pictures;
 	struct pict_info *pi;
 
-	for (i = 1; i <= pictures; i++) {
-		pi = &pinfo[i];
-		if (!force && pi->ondisk)
-			continue;
+	if (!picnums) {
+		if (start > first)
+			first = start;
+		if (end < last)
+			last = end;
+	}
+	/* The catalog cache makes this cheaper than frame by frame */
+	if (!list_complete && first == 1 && last == pictures)
+		complete_picture_list();
+	for (i = first; i <= last; i++) {
+		pi = pict(i);
 		num = picnums ? pi->number : i;
 		if (num < start || num > end)
 			continue;
-		download_picture(i);
+		action(i);
 	}
 }
 
-int dc_free_memory (void)
+/* Download a picture, unless it's already there */
+void download_new (int n)
 {
-	cmd0 (0, 0x1B, 0);
-	return answer[5] + (answer[6]<<8) + (answer[7]<<16) + (answer[8]<<24);
+	if (pinfo[n].deleted != 1 && (force || !pict(n)->ondisk))
+		download_picture(n);
 }
 
-int delete_pic (const char *picname)
+/*
+ * Delete the pictures downloaded, once safely on the disk (verified and
+ * synced, see verify.c); with "wait", all of them.
+ */
+void delete_synced (int wait)
 {
-	int i, ret;
+	struct pict_info *pi;
+	int c, ret, transferred;
+
+	for (c = pictures; c > 0; c--) {
+		pi = &pinfo[c];
+		pthread_mutex_lock(&stats_lock);
+		transferred = pi->transferred;
+		pthread_mutex_unlock(&stats_lock);
+		if (!transferred || pi->deleted)
+			continue;
+		ret = wait ? verify_wait(&pi->verified) : verify_poll(&pi->verified);
+		if (ret == VERIFY_PENDING)
+			continue;
+		if (ret != VERIFY_OK) {
+			printf("%s%s not verified, not deleted\n", cur_link->tag, pi->name);
+			pi->deleted = -1;
+			continue;
+		}
+		if (check(dc_delete_frame(cam, camera_frame(c))) == 0) {
+			pi->deleted = 1;
+			cur_link->deleted++;
+		} else
+			pi->deleted = -1;
+	}
+}
 
-	for (i = 1; i <= pictures; i++)
-	  if (!strcmp(pinfo[i].name, picname)) {
-	    if ((ret = del_frame(i)) == 0)
-	      get_picture_list();
-	    return ret;
-	  }
-	return -1;
+void download_delete (int n)
+{
+	download_new(n);
+	delete_synced(0);
+}
+
+/*
+ * With several links, the threads of the links only queue the pictures
+ * to download, and ingest() then drives all the cameras at once.
+ */
+void queue_download (int n)
+{
+	struct link *ln = cur_link;
+	struct job *jb;
+	int i;
+
+	if (!force && pict(n)->ondisk)
+		return;
+	/* Once only, as the frame numbers change with "-d" */
+	for (i = 0; i < ln->njobs; i++)
+		if (ln->jobs[i].frame == n)
+			return;
+	if (ln->njobs % 64 == 0) {
+		ln->jobs = realloc(ln->jobs, (ln->njobs + 64) * sizeof(struct job));
+		if (ln->jobs == NULL) {
+			perror("Cannot queue downloads");
+			die();
+		}
+	}
+	jb = &ln->jobs[ln->njobs++];
+	jb->link = ln;
+	jb->frame = n;
+	jb->name = strdup(pinfo[n].name);
+	jb->size = pinfo[n].size;
+	jb->committed = jb->transferred = jb->deleted = 0;
+	if (jb->name == NULL) {
+		perror("Cannot queue downloads");
+		die();
+	}
+}
+
+/*
+ * Frame number of the latest picture, found with command 0x15 if
+ * possible. Returns 0 if there are no pictures.
+ */
+int find_latest (void)
+{
+	char *name;
+	int i;
+
+	if (pictures == 0)
+		return 0;
+	if (!list_complete && cam->has_cmd[0x15]) {
+		name = strdup(check_str(dc_latest_picture(cam)));
+		/* Normally the last frame */
+		i = strcmp(pict(pictures)->name, name) ? 0 : pictures;
+		free(name);
+		if (i)
+			return i;
+	}
+	if (!list_complete)
+		complete_picture_list();
+	for (i = pictures; i > 0; i--)
+		if (pinfo[i].number == maxnum)
+			return i;
+	return 0;
+}
+
+/*
+ * Apply "action" to the pictures given on the command line ("all",
+ * "last", "4" or "2-10").
+ */
+void picture_args (int argc, char **argv, void (*action)(int))
+{
+	char *arg, *dash;
+	int i, n;
+
+	for (i = 0; i < argc; i++) {
+		arg = argv[i];
+		dash = strchr(arg, '-');
+		if (!strcmp(arg, "all"))
+		  picture_range(0, 99999, 0, action);
+		else if (!strcmp(arg, "last")) {
+		  if ((n = find_latest()) != 0)
+		    action(n);
+		} else if (dash)
+		  picture_range(atoi(arg), atoi(dash+1), picnums, action);
+		else
+		  picture_range(atoi(arg), atoi(arg), picnums, action);
+	}
+}
+
+/*
+ * Catalog: only the beginning of the pictures is transferred (0x00),
+ * which is enough to get the Exif header, with the date, the dimensions
+ * and the thumbnail. The index goes into CATALOG_FILE, and with "-t"
+ * the thumbnails are saved into THUMB_DIR, with a contact sheet.
+ */
+#define CATALOG_FILE	"catalog.txt"
+#define CONTACT_SHEET	"catalog.html"
+#define THUMB_DIR	"thumbs"
+#define EXIF_MAX	65536
+
+PER_LINK FILE *catalog_fd, *sheet_fd;
+
+int save_thumbnail (const char *name, unsigned char *data, int len)
+{
+	struct outfile *of;
+
+	mkdir(THUMB_DIR, 0777);
+	if ((of = out_create(name, len)) == NULL)
+		return -1;
+	if (out_write(of, 0, data, len) < 0) {
+		out_abort(of);
+		return -1;
+	}
+	return out_commit(of, name, 1);
+}
+
+void catalog_picture (int n)
+{
+	static PER_LINK unsigned char header[EXIF_MAX];
+	struct pict_info *pi = pict(n);
+	struct exif_info ex;
+	struct outfile out;
+	struct fuji_sink sink = { sink_write, &out };
+	char dims[24], thumb[300];
+	int len;
+
+	memset(&out, 0, sizeof(out));
+	out.fd = -1;
+	out.mem = header;
+	out.size = sizeof(header);
+	check(dc_get_exif(cam, n, &sink));
+	writer_sync();
+	len = (out.written < out.size) ? out.written : out.size;
+	if (exif_parse(header, len, &ex) < 0)
+		fprintf(stderr, "%s%s: no Exif header\n", cur_link->tag, pi->name);
+	if (ex.width && ex.height)
+		sprintf(dims, "%dx%d", ex.width, ex.height);
+	else
+		strcpy(dims, "-");
+	if (!ex.date[0])
+		strcpy(ex.date, "-");
+	printf("%s%3d   %12s  %7d  %19s  %9s\n", cur_link->tag, n, pi->name,
+		pi->size, ex.date, dims);
+	fprintf(catalog_fd, "%3d   %12s  %7d  %19s  %9s\n", n, pi->name,
+		pi->size, ex.date, dims);
+	if (!thumbnails)
+		return;
+	thumb[0] = '\0';
+	if (ex.thumb_length) {
+		sprintf(thumb, "%s/%.250s", THUMB_DIR, pi->name);
+		if (save_thumbnail(thumb, header + ex.thumb_offset, ex.thumb_length) < 0) {
+			fprintf(stderr, "Cannot save %s: %s\n", thumb, strerror(errno));
+			thumb[0] = '\0';
+		}
+	}
+	fprintf(sheet_fd, "<div class=\"pic\"><a href=\"%s\">", pi->name);
+	if (thumb[0])
+		fprintf(sheet_fd, "<img src=\"%s\" alt=\"%s\">", thumb, pi->name);
+	else
+		fprintf(sheet_fd, "(no thumbnail)");
+	fprintf(sheet_fd, "</a><br>%d: %s<br>%s<br>%s, %d bytes</div>\n",
+		n, pi->name, ex.date, dims, pi->size);
+}
+
+int make_catalog (int argc, char **argv)
+{
+	static char *all[] = { "all" };
+
+	if ((catalog_fd = fopen(CATALOG_FILE, "w")) == NULL) {
+		perror("Cannot create " CATALOG_FILE);
+		return 1;
+	}
+	if (thumbnails) {
+		if ((sheet_fd = fopen(CONTACT_SHEET, "w")) == NULL) {
+			perror("Cannot create " CONTACT_SHEET);
+			fclose(catalog_fd);
+			return 1;
+		}
+		fprintf(sheet_fd, "<html><head><title>Pictures</title>\n"
+			"<style>.pic { display: inline-block; width: 170px; "
+			"margin: 4px; text-align: center; font-size: small }</style>\n"
+			"</head><body>\n");
+	}
+	get_picture_count();
+	if (argc == 0)
+		picture_args(1, all, catalog_picture);
+	else
+		picture_args(argc, argv, catalog_picture);
+	if (thumbnails) {
+		fprintf(sheet_fd, "</body></html>\n");
+		fclose(sheet_fd);
+	}
+	if (fclose(catalog_fd) != 0) {
+		perror("Cannot write " CATALOG_FILE);
+		return 1;
+	}
+	return 0;
+}
+
+/* The highest picture number, for naming uploaded pictures */
+int highest_number (void)
+{
+	char *name;
+	int num;
+
+	if (!maxnum_known) {
+		if (!cam->has_cmd[0x15]) {
+			get_picture_list();
+			return maxnum;
+		}
+		name = check_str(dc_latest_picture(cam));
+		num = atoi(name + strcspn(name, "0123456789"));
+		if (num > maxnum)
+			maxnum = num;
+		maxnum_known = 1;
+	}
+	return maxnum;
+}
+
+static unsigned long name_hash (const char *name)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*name)
+		h = (h ^ (unsigned char) *name++) * 16777619UL;
+	return h;
+}
+
+/*
+ * Delete the pictures named on the command line (a directory is
+ * ignored, so that "delete archive/DSC*.JPG" works). The names are
+ * looked up in a hash table of the picture list, and the frames deleted
+ * from the last to the first, so that the numbers of those remaining
+ * don't change: the list is then updated here, and the catalog cache
+ * with it (removed once the card is empty), rather than enumerated
+ * again. A frame the camera refuses to delete stays in the list.
+ */
+int delete_pics (int argc, char **argv)
+{
+	struct catalog_key key;
+	unsigned long size, h;
+	int *slot, i, j, deleted = 0, status = 0;
+	char *doomed, *path;
+	const char *name;
+
+	get_picture_list();
+	for (size = 16; size < 2 * (unsigned long) pictures; size <<= 1)
+		;
+	slot = calloc(size, sizeof(int));
+	doomed = calloc(pictures+1, 1);
+	if (slot == NULL || doomed == NULL) {
+		perror("Cannot delete");
+		die();
+	}
+	/* Open addressing, 0 is free */
+	for (i = 1; i <= pictures; i++) {
+		for (h = name_hash(pinfo[i].name) & (size-1); slot[h]; h = (h+1) & (size-1))
+			;
+		slot[h] = i;
+	}
+	for (j = 0; j < argc; j++) {
+		name = strrchr(argv[j], '/') ? strrchr(argv[j], '/') + 1 : argv[j];
+		for (h = name_hash(name) & (size-1); (i = slot[h]) != 0; h = (h+1) & (size-1))
+			if (!strcmp(pinfo[i].name, name))
+				break;
+		if (i == 0) {
+			fprintf(stderr, "%s%s: no such picture\n", cur_link->tag, name);
+			status = 1;
+		} else
+			doomed[i] = 1;
+	}
+	free(slot);
+	for (i = pictures; i > 0; i--) {
+		if (!doomed[i])
+			continue;
+		if (check(dc_delete_frame(cam, i))) {
+			/* Still on the card (protected?) */
+			fprintf(stderr, "%s%s: refused by the camera\n",
+				cur_link->tag, pinfo[i].name);
+			doomed[i] = 0;
+			status = 1;
+		} else
+			deleted++;
+	}
+	/* What the camera now has */
+	for (i = j = 1; i <= pictures; i++) {
+		if (doomed[i])
+			free(pinfo[i].name);
+		else
+			pinfo[j++] = pinfo[i];
+	}
+	pictures = j - 1;
+	free(doomed);
+	if (use_cache && cam->has_cmd[0x80] && cam->has_cmd[0x15]) {
+		strcpy(key.id, check_str(fuji_camera_key(cam)));
+		if (pictures == 0) {
+			/* Nothing left to remember */
+			if ((path = cache_file("catalog", key.id)) != NULL)
+				remove(path);
+		} else {
+			sprintf(key.latest, "%.63s", check_str(dc_latest_picture(cam)));
+			save_cache_file(cache_file("catalog", key.id), emit_catalog, &key);
+		}
+	}
+	printf("%sDeleted %d picture(s).\n", cur_link->tag, deleted);
+	return status;
 }
 
 char* auto_rename (void)
 {
-	static char buffer[13];
-	
-	if (maxnum < 99999)
+	static PER_LINK char buffer[16];
+
+	if (highest_number() < 99999)
 		maxnum++;
 
 	sprintf(buffer, "DSC%05d.JPG", maxnum);
 	return buffer;
 }
 
-int upload_pic (const char *picname)
+/*
+ * Batch upload. All the files are mapped first, so that the free space
+ * is checked once for the whole batch (the card allocates 512-byte
+ * blocks; files which don't fit are skipped) and the names are
+ * allocated at once, above both the camera's latest picture and the
+ * DSCxxxxx.JPG files of the batch.
+ */
+#define CARD_BLOCK	512
+
+struct upload {
+	const char *path;
+	char name[16];
+	unsigned char *data;
+	long size;
+};
+
+static int is_dsc_name (const char *name)
+{
+	return strlen(name) == 12 && !memcmp(name, "DSC", 3)
+		&& !memcmp(name+8, ".JPG", 4);
+}
+
+/* Map a file to upload. Returns 0, or -1 after an error message */
+static int upload_open (struct upload *up, const char *path)
 {
-	unsigned char buffer[516];
-	const char *p;
 	struct stat st;
-	FILE *fd;
-	int c, last, len, free_space;
+	const char *p;
+	int fd;
+
+	up->path = path;
+	up->data = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Cannot open file %s for upload\n", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	up->size = st.st_size;
+	if (up->size > 0)
+		up->data = mmap(NULL, up->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (up->size <= 0 || up->data == MAP_FAILED) {
+		fprintf(stderr, "Cannot read file %s for upload\n", path);
+		up->data = NULL;
+		return -1;
+	}
+	madvise(up->data, up->size, MADV_SEQUENTIAL);
+	p = strrchr(path, '/');
+	strcpy(up->name, is_dsc_name(p ? p+1 : path) ? (p ? p+1 : path) : "");
+	return 0;
+}
 
-	fd = fopen(picname, "r");
-	if (fd == NULL) {
-		fprintf(stderr, "Cannot open file %s for upload\n", picname);
+/* Send the file; returns 1 if it has been accepted by the camera */
+static int upload_one (struct upload *up)
+{
+	int ret = dc_upload(cam, up->name, up->data, up->size);
+
+	if (ret == FUJI_ERR_REFUSED) {
+		fprintf(stderr, "  %s\n", cam->error);
 		return 0;
 	}
-	if (fstat(fileno(fd), &st) < 0) {
-		perror("fstat");
-		return 0;
+	check(ret);
+	return 1;
+}
+
+int upload_pics (int n, char **paths)
+{
+	struct upload *ups;
+	long free_space, need, blocks, bytes = 0;
+	double t0, t1, t;
+	int i, num, count = 0;
+
+	if ((ups = calloc(n, sizeof(struct upload))) == NULL) {
+		perror("Cannot allocate upload list");
+		die();
 	}
-	free_space = dc_free_memory();
-	fprintf(stderr, "Uploading %s (size %d, available %d bytes)\n",
-		picname, (int) st.st_size, free_space);
-	if (st.st_size > free_space) {
-		fprintf(stderr, "  not enough space\n");
-		return 0;
+	for (i = 0; i < n; i++)
+		upload_open(&ups[i], paths[i]);
+
+	/* What fits on the card, in the order given */
+	free_space = check(dc_free_memory(cam));
+	need = 0;
+	for (i = 0; i < n; i++) {
+		if (ups[i].data == NULL)
+			continue;
+		blocks = (ups[i].size + CARD_BLOCK - 1) / CARD_BLOCK;
+		if (need + blocks * CARD_BLOCK > free_space) {
+			fprintf(stderr, "Not enough space for %s (size %ld, available %ld bytes)\n",
+				ups[i].path, ups[i].size, free_space - need);
+			munmap(ups[i].data, ups[i].size);
+			ups[i].data = NULL;
+			continue;
+		}
+		need += blocks * CARD_BLOCK;
 	}
-	if ((p = strrchr(picname, '/')) != NULL)
-		picname = p+1;
-	if (strlen(picname) != 12 || memcmp(picname,"DSC",3) || memcmp(picname+8,".JPG",4)) {
-		picname = auto_rename();
-		fprintf(stderr, "  file renamed %s\n", picname);
-	}
-	buffer[0] = 0;
-	buffer[1] = 0x0F;
-	buffer[2] = 12;
-	buffer[3] = 0;
-	memcpy(buffer+4, picname, 12);
-	cmd(16, buffer, 0);
-	if (answer[4] != 0) {
-		fprintf(stderr, "  rejected by the camera\n");
-		return 0;
+
+	/* Names for the other files, after all the known ones */
+	for (i = 0; i < n; i++)
+		if (ups[i].data != NULL && !ups[i].name[0])
+			break;
+	if (i < n) {
+		highest_number();
+		for (i = 0; i < n; i++)
+			if (ups[i].data != NULL && ups[i].name[0]
+			    && (num = atoi(ups[i].name+3)) > maxnum)
+				maxnum = num;
+		for (i = 0; i < n; i++)
+			if (ups[i].data != NULL && !ups[i].name[0])
+				strcpy(ups[i].name, auto_rename());
 	}
-	buffer[1] = 0x0E;
-	while(1) {
-		len = fread(buffer+4, 1, 512, fd);
-		if (!len) break;
-		buffer[2] = len;
-		buffer[3] = (len>>8);
-		last = 1;
-		if ((c = getc(fd)) != EOF) {
-			last = 0;
-			ungetc(c, fd);
-		}
-		if (!last && interrupted) {
-			fprintf(stderr, "Interrupted!\n");
-			exit(1);
-		}
-again:
-		send_packet(4+len, buffer, last);
-		wait_for_input(1);
-		if (get_byte() == 0x15)
-			goto again;
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		if (ups[i].data == NULL)
+			continue;
+		fprintf(stderr, "%sUploading %s as %s (size %ld)\n",
+			cur_link->tag, ups[i].path, ups[i].name, ups[i].size);
+		t1 = now();
+		if (upload_one(&ups[i])) {
+			t = now() - t1;
+			fprintf(stderr, "  %.1f seconds, %.0f bytes/s\n",
+				t, ups[i].size / (t > 0 ? t : 1e-3));
+			count++;
+			bytes += ups[i].size;
+			pthread_mutex_lock(&stats_lock);
+			cur_link->pictures++;
+			cur_link->bytes += ups[i].size;
+			cur_link->seconds += t;
+			pthread_mutex_unlock(&stats_lock);
+		}
+		munmap(ups[i].data, ups[i].size);
 	}
-	fclose(fd);
-	fprintf(stderr, "  looks ok\n");
-	return 1;
+	t = now() - t0;
+	fprintf(stderr, "%sUploaded %d of %d file(s), %ld bytes in %.1f seconds, %.0f bytes/s\n",
+		cur_link->tag, count, n, bytes, t, bytes / (t > 0 ? t : 1e-3));
+	free(ups);
+	return count == n ? 0 : 1;
 }
 
 const char *Usage = "\
@@ -764,22 +1816,35 @@ Usage: fujiplay [OPTIONS] PICTURES...          (download)\r\n\
                           charge NUMBER        (recharge the flash)\r\n\
                           shoot                (take picture)\r\n\
                           preview              (preview to standard output)\r\n\
+                          live [FRAMES]        (stream of previews)\r\n\
                           upload FILES...\r\n\
                           delete FILES...\r\n\
                           setid STRING         (set camera ID)\r\n\
                           setflash MODE        (0=Off, 1=On, 2=Strobe, 3=Auto)\r\n\
                           setdate gmt|local|YYYYMMDDHHMMSS\r\n\
+                          catalog PICTURES...  (Exif headers only)\r\n\
 Options:\r\n\
   -B NUMBER	Set baudrate (115200, 57600, 38400, 19200, 9600 or 0)\r\n\
+  -A DIR	Skip the pictures already in the archive DIR (see README)\r\n\
+  -C		Do not use the cache in ~/.fujiplay\r\n\
   -D DEVICE	Select another device file (default is /dev/fujifilm)\r\n\
+		May be repeated, to drive several cameras at once\r\n\
   -L		List command set\r\n\
+  -l		Low-latency serial timing (timeouts from the line speed)\r\n\
   -7		DS-7 compatibility mode (experimental)\r\n\
   -d		Delete pictures after successful download\r\n\
   -f		Force (overwrite existing files)\r\n\
   -p		Assume picture numbers instead of frame numbers\r\n\
+  -t		With catalog, save the thumbnails and a contact sheet\r\n\
+  -o FORMAT	Preview format: raw (default), ppm, png or y4m\r\n\
   -h		Display this help message\r\n\
   -v		Version information\r\n\
   -i 		Print information logs\r\n\
+  -S FILE	Write transfer statistics to FILE (JSON), at exit\r\n\
+		and on SIGUSR1; - is standard error\r\n\
+  -T FILE	Write the pictures into the tar archive FILE instead\r\n\
+		(- is standard output)\r\n\
+  -W FILE	Capture the serial traffic into FILE (see fujireplay)\r\n\
 Pictures:\r\n\
   all		All pictures\r\n\
   last		Last picture\r\n\
@@ -800,102 +1865,139 @@ static void sigint_handler (int sig)
 	interrupted = 1;
 }
 
-int main (int argc, char **argv)
+static void sigusr1_handler (int sig)
 {
-	extern char *optarg;
-	extern int optind, opterr, optopt;
+	stats_requested = 1;
+}
 
-	int i, c, deleted;
-	int ds7_compat=0, force=0, picnums=0, delete_after=0, info=0;
-	struct sigaction s2act;
-	time_t now;
-	struct tm *ptm;
-	char datebuff[50];
-	char *devname = DEFAULT_DEVICE;
-	char *dash, *arg;
+/*
+ * Take a preview and write it to standard output, converted on the fly
+ * into the format selected with "-o".
+ */
+int take_preview (void)
+{
+	struct outfile out = out_stdout;
+	struct fuji_sink sink = { sink_write, &out };
+	struct preview pv;
+	int error;
 
-	s2act.sa_handler = sigint_handler;
-	sigemptyset(&s2act.sa_mask); s2act.sa_flags = 0;
-	sigaction(SIGINT, &s2act, NULL);
+	preview_init(&pv, preview_fmt, 1);
+	out.preview = &pv;
+	check(dc_take_preview(cam));
+	check(dc_get_preview(cam, &sink));
+	writer_end(&out);
+	error = writer_sync();
+	preview_free(&pv);
+	if (error) {
+		fprintf(stderr, "Cannot write preview: %s\n", strerror(error));
+		return 1;
+	}
+	return 0;
+}
 
-	/* Command line parsing */
-	while ((c = getopt(argc,argv,"B:D:L7dfhpvi")) != EOF)
-	switch(c) {
-		case 'B':
-			desired_speed = atoi(optarg);
-			break;
-		case 'D':
-			devname = optarg;
-			break;
-		case 'L':
-			list_command_set = 1;
-			break;
-		case '7':
-			ds7_compat = 1;
-			break;
-		case 'd':
-			delete_after = 1;
-			break;
-		case 'f':
-			force = 1;
-			break;
-		case 'p':
-			picnums = 1;
-			break;
-		case 'h':
-			printf(Usage);
-			return 0;
-		case 'v':
-			printf(Copyright);
-			return 0;
-		case 'i':
-			info = 1;
+static void live_sigint (int sig)
+{
+	/* Finish the current frame; a second ^C interrupts it */
+	if (live_stop)
+		interrupted = 1;
+	live_stop = 1;
+}
+
+/*
+ * Live view: take previews in a loop, as fast as the link allows, and
+ * stream them to standard output ("-o y4m", the default, or "-o ppm" for
+ * a multi-image PPM). Each frame is completed by the writer thread while
+ * the next one is taken. Stops after "count" frames (0 means ^C), or
+ * when the reader goes away, then prints the frame rate and latency.
+ */
+int live_view (int count)
+{
+	struct outfile out = out_stdout;
+	struct fuji_sink sink = { sink_write, &out };
+	struct preview pv;
+	struct live lv;
+	struct sigaction sa, old_int, old_pipe;
+	double t0, t;
+	int n, error;
+
+	memset(&lv, 0, sizeof(lv));
+	lv.lat_min = 1e9;
+	preview_init(&pv, preview_fmt == PREVIEW_RAW ? PREVIEW_Y4M : preview_fmt, 1);
+	out.preview = &pv;
+	out.live = &lv;
+
+	sa.sa_handler = live_sigint;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGINT, &sa, &old_int);
+	sa.sa_handler = SIG_IGN;	/* EPIPE instead */
+	sigaction(SIGPIPE, &sa, &old_pipe);
+
+	t0 = now();
+	error = 0;
+	for (n = 0; (count == 0 || n < count) && !live_stop; n++) {
+		lv.taken[n % WRITE_BUFFERS] = now();
+		check(dc_take_preview(cam));
+		check(dc_get_preview(cam, &sink));
+		writer_end(&out);
+		if ((error = writer_error()) != 0)
 			break;
-		default:
-			fprintf(stderr, Usage);
-			return 1;
 	}
+	if (!error)
+		error = writer_sync();
+	t = now() - t0;
+	preview_free(&pv);
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGPIPE, &old_pipe, NULL);
+
+	if (t <= 0)
+		t = 1e-3;
+	fprintf(stderr, "%sLive view: %d frames in %.1f s, %.2f fps, %.0f bytes/s\n",
+		cur_link->tag, lv.frames, t, lv.frames / t, out.written / t);
+	if (lv.frames)
+		fprintf(stderr, "%sLatency: %.0f ms min, %.0f ms avg, %.0f ms max\n",
+			cur_link->tag, 1000 * lv.lat_min,
+			1000 * lv.lat_sum / lv.frames, 1000 * lv.lat_max);
+	if (error && error != EPIPE) {
+		fprintf(stderr, "Cannot write preview: %s\n", strerror(error));
+		return 1;
+	}
+	return 0;
+}
 
+/*
+ * Execute the command given by argv[0..argc-1] (no argument means
+ * "list pictures") on one link. Returns the exit status.
+ */
+int run_link (struct link *ln, int argc, char **argv)
+{
+	int i, c;
+	time_t t;
+	struct tm *ptm;
+	char datebuff[50];
+	char *arg;
+
+	cur_link = ln;
 	if(info) {
-		fprintf(stderr, "Using device %s\n", devname);
-	}
-	init_serial(devname);
-	if (info)
-	{
-		fprintf(stderr, "Connection established.\n");
-		fprintf(stderr, "Set baudrate...\n");
-	}
-	set_baudrate(info);
-	if (info)
-	{
-		fprintf(stderr, "Getting command list...\n");
-	}
-	get_command_list(ds7_compat);
-	if (info)
-	{
-		fprintf(stderr, "Getting picture list...\n");
+		fprintf(stderr, "Using device %s\n", ln->device);
 	}
-	get_picture_list();
-	if (info)
-	{
-		fprintf(stderr, "%d pictures on the camera.\n", pictures);
-	}
-
-	if (optind == argc) {
-		if (has_cmd[0x09])
-			fprintf(stderr, "Version info: %s\n", dc_version_info());
-		if (has_cmd[0x29])
-			fprintf(stderr, "Camera type : %s\n", dc_camera_type());
-		if (has_cmd[0x84])
-			fprintf(stderr, "Camera date : %s\n", dc_get_date());
-		if (has_cmd[0x80])
-			fprintf(stderr, "Camera ID   : %s\n", dc_camera_id());
-		if (has_cmd[0x1B])
-			fprintf(stderr, "Free memory : %d kb\n", dc_free_memory() >> 10);
-		if (has_cmd[0x30]) {
+	init_serial(ln);
+
+	if (argc == 0) {
+		if (cam->has_cmd[0x09])
+			fprintf(stderr, "%sVersion info: %s\n", ln->tag, check_str(dc_version_info(cam)));
+		if (cam->has_cmd[0x29])
+			fprintf(stderr, "%sCamera type : %s\n", ln->tag, check_str(dc_camera_type(cam)));
+		if (cam->has_cmd[0x84])
+			fprintf(stderr, "%sCamera date : %s\n", ln->tag, check_str(dc_get_date(cam)));
+		if (cam->has_cmd[0x80])
+			fprintf(stderr, "%sCamera ID   : %s\n", ln->tag, check_str(dc_camera_id(cam)));
+		if (cam->has_cmd[0x1B])
+			fprintf(stderr, "%sFree memory : %d kb\n", ln->tag, check(dc_free_memory(cam)) >> 10);
+		if (cam->has_cmd[0x30]) {
 			int flashmode;
 			char *tmode;
-			flashmode = dc_get_flash_mode();
+			flashmode = check(dc_get_flash_mode(cam));
 			switch(flashmode) {
 				case 0:  tmode = "off";    break;
 				case 1:  tmode = "on";     break;
@@ -903,60 +2005,67 @@ int main (int argc, char **argv)
 				case 3:  tmode = "auto";   break;
 				default: tmode = "unknown";
 			}
-			fprintf(stderr, "Flash mode  : %d (%s)\n", flashmode, tmode);
+			fprintf(stderr, "%sFlash mode  : %d (%s)\n", ln->tag, flashmode, tmode);
 		}
+		get_picture_list();
 		list_pictures();
 		return 0;
 	}
-	if (!strcmp(argv[optind], "charge") && optind+1 < argc) {
-		if (!has_cmd[0x34]) {
+	if (!strcmp(argv[0], "charge") && 1 < argc) {
+		if (!cam->has_cmd[0x34]) {
 			fprintf(stderr, "Cannot charge flash (unsupported command)\n");
 			return 1;
 		}
-		arg = argv[optind+1];
-		charge_flash(atoi(arg));
+		arg = argv[1];
+		check(dc_charge_flash(cam, atoi(arg)));
 		return 0;
 	}
-	if (!strcmp(argv[optind], "shoot")) {
-		if (!has_cmd[0x27]) {
+	if (!strcmp(argv[0], "shoot")) {
+		if (!cam->has_cmd[0x27]) {
 			fprintf(stderr, "Cannot shoot (unsupported command)\n");
 			return 1;
 		}
-		c = take_picture();
-		printf("%3d   %12s  %7d\n", c, dc_picture_name(c), dc_picture_size(c));
+		c = check(dc_take_picture(cam));
+		i = check(dc_picture_size(cam, c));
+		printf("%s%3d   %12s  %7d\n", ln->tag, c, check_str(dc_picture_name(cam, c)), i);
 		return 0;
 	}
-	if (!strcmp(argv[optind], "preview")) {
-		if (!has_cmd[0x62] || !has_cmd[0x64]) {
+	if (!strcmp(argv[0], "preview")) {
+		if (!cam->has_cmd[0x62] || !cam->has_cmd[0x64]) {
 			fprintf(stderr, "Cannot preview (unsupported command)\n");
 			return 1;
 		}
-		cmd0(0, 0x64, 0);
-		cmd0(0, 0x62, stdout);
-		return 0;
+		return take_preview();
 	}
-	if (!strcmp(argv[optind], "setid") && optind+1 < argc) {
-		if (!has_cmd[0x82]) {
+	if (!strcmp(argv[0], "live")) {
+		if (!cam->has_cmd[0x62] || !cam->has_cmd[0x64]) {
+			fprintf(stderr, "Cannot preview (unsupported command)\n");
+			return 1;
+		}
+		return live_view(argc > 1 ? atoi(argv[1]) : 0);
+	}
+	if (!strcmp(argv[0], "setid") && 1 < argc) {
+		if (!cam->has_cmd[0x82]) {
 			fprintf(stderr, "Cannot set camera ID (unsupported command)\n");
 			return 1;
 		}
-		arg = argv[optind+1];
-		dc_set_camera_id(arg);
+		arg = argv[1];
+		check(dc_set_camera_id(cam, arg));
 		return 0;
 	}
-	if (!strcmp(argv[optind], "setdate") && optind+1 < argc) {
-		if (!has_cmd[0x86]) {
+	if (!strcmp(argv[0], "setdate") && 1 < argc) {
+		if (!cam->has_cmd[0x86]) {
 			fprintf(stderr, "Cannot set date (unsupported command)\n");
 			return 1;
 		}
-		arg = argv[optind+1];
-		now = time(0);
+		arg = argv[1];
+		t = time(0);
 		if (!strcmp(arg, "gmt") || !strcmp(arg, "utc")) {
-			ptm = gmtime(&now);
+			ptm = gmtime(&t);
 			goto set_date_from_tm;
 		}
 		if (!strcmp(arg, "local")) {
-			ptm = localtime(&now);
+			ptm = localtime(&t);
 			goto set_date_from_tm;
 		}
 		goto set_date_from_arg;
@@ -967,53 +2076,609 @@ set_date_from_tm:
 		fprintf(stderr, "Current date (%s) is %s\n", arg, datebuff);
 		arg = datebuff;
 set_date_from_arg:
-		dc_set_date(arg);
+		check(dc_set_date(cam, arg));
 		return 0;
 	}
-	if (!strcmp(argv[optind], "setflash") && optind+1 < argc) {
-		if (!has_cmd[0x32]) {
+	if (!strcmp(argv[0], "setflash") && 1 < argc) {
+		if (!cam->has_cmd[0x32]) {
 			fprintf(stderr, "Cannot set flash mode (unsupported command)\n");
 			return 1;
 		}
-		arg = argv[optind+1];
-		dc_set_flash_mode(atoi(arg));
+		arg = argv[1];
+		check(dc_set_flash_mode(cam, atoi(arg)));
 		return 0;
 	}
-	if (!strcmp(argv[optind], "delete")) {
+	if (!strcmp(argv[0], "delete")) {
 		/* Always supported, I guess */
-		for (i = optind+1; i < argc; i++)
-		    delete_pic(argv[i]);
-		return 0;
+		return delete_pics(argc - 1, argv + 1);
+	}
+	if (!strcmp(argv[0], "catalog")) {
+		if (!cam->has_cmd[0x00]) {
+			fprintf(stderr, "Cannot read Exif headers (unsupported command)\n");
+			return 1;
+		}
+		return make_catalog(argc - 1, argv + 1);
 	}
-	if (!strcmp(argv[optind], "upload")) {
-		if (!has_cmd[0x0e] || !has_cmd[0x0f]) {
+	if (!strcmp(argv[0], "upload")) {
+		if (!cam->has_cmd[0x0e] || !cam->has_cmd[0x0f]) {
 			fprintf(stderr, "Cannot upload pictures (unsupported command)\n");
 			return 1;
 		}
-		for (i = optind+1; i < argc; i++)
-		    upload_pic(argv[i]);
+		return upload_pics(argc - 1, argv + 1);
+	}
+	get_picture_count();
+	if (ingest_mode) {
+		picture_args(argc, argv, queue_download);
+		ln->queued = 1;
 		return 0;
 	}
-	printf("Loading pictures:\n");
-	for (i = optind; i < argc; i++) {
-		arg = argv[i];
-		dash = strchr(arg, '-');
-		if (!strcmp(arg, "all"))
-		  download_range(0, 99999, 0, force);
-		else if (!strcmp(arg, "last"))
-		  download_range(maxnum, maxnum, 1, force);
-		else if (dash)
-		  download_range(atoi(arg), atoi(dash+1), picnums, force);
+	/* The pictures of an archive are not checked */
+	if (tar_fd < 0 && verify_start(MANIFEST_FILE, delete_after) < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", MANIFEST_FILE, strerror(errno));
+		return 1;
+	}
+	if (nlinks == 1)
+		printf("Loading pictures:\n");
+	if (delete_after) {
+		/* The names can't be fetched once frames are deleted */
+		if (!list_complete)
+			complete_picture_list();
+		picture_args(argc, argv, download_delete);
+		check_commits(1);
+		delete_synced(1);
+		printf("%sDeleted %d picture(s).\n", ln->tag, ln->deleted);
+	} else {
+		picture_args(argc, argv, download_new);
+		check_commits(1);
+	}
+	return verify_sync() > 0;
+}
+
+void add_link (char *device)
+{
+	struct link *ln;
+	char *base;
+
+	if (nlinks == MAX_LINKS) {
+		fprintf(stderr, "Too many devices (at most %d)\n", MAX_LINKS);
+		exit(1);
+	}
+	ln = &links[nlinks++];
+	ln->device = device;
+	base = strrchr(device, '/');
+	base = base ? base+1 : device;
+	sprintf(ln->tag, "%.24s: ", base);
+	if ((ln->ses = fuji_new()) == NULL) {
+		perror("Cannot allocate session");
+		exit(1);
+	}
+}
+
+struct link_args {
+	struct link *ln;
+	int argc;
+	char **argv;
+};
+
+static void *link_thread (void *arg)
+{
+	struct link_args *la = arg;
+	int status;
+
+	status = run_link(la->ln, la->argc, la->argv);
+	writer_stop();
+	/* Queued downloads are done by the main thread, on the same session */
+	if (!la->ln->queued)
+		reset_serial();
+	pthread_mutex_lock(&stats_lock);
+	la->ln->status = status;
+	pthread_mutex_unlock(&stats_lock);
+	return NULL;
+}
+
+void print_progress (int summary, double elapsed)
+{
+	struct link *ln;
+	long bytes = 0;
+	int pics = 0;
+
+	pthread_mutex_lock(&stats_lock);
+	for (ln = links; ln < links + nlinks; ln++) {
+		if (summary)
+			printf("  %-24s %4d pictures  %9ld bytes  %6.1f s  %6.0f bytes/s\n",
+				ln->device, ln->pictures, ln->bytes, ln->seconds,
+				ln->seconds > 0 ? ln->bytes / ln->seconds : 0.0);
+		pics += ln->pictures;
+		bytes += ln->bytes;
+	}
+	pthread_mutex_unlock(&stats_lock);
+	if (elapsed <= 0)
+		elapsed = 1e-3;
+	if (summary)
+		printf("  %-24s %4d pictures  %9ld bytes  %6.1f s  %6.0f bytes/s\n",
+			"total", pics, bytes, elapsed, bytes / elapsed);
+	else if (pics)
+		fprintf(stderr, "Progress: %d pictures, %ld bytes, %.0f bytes/s\n",
+			pics, bytes, bytes / elapsed);
+}
+
+/* Report the combined progress every ten seconds */
+void progress_tick (double t0, double *tick)
+{
+	if (stats_requested)
+		write_stats();
+	if (now() - *tick >= 10) {
+		*tick = now();
+		print_progress(0, *tick - t0);
+	}
+}
+
+/* Make "ln" the current link of the main thread */
+void use_link (struct link *ln)
+{
+	cur_link = ln;
+	cam = ln->ses;
+	cur_out = ln->out;
+}
+
+static int ingest_write (void *arg, long offset, const unsigned char *data, int len)
+{
+	struct link *ln = arg;
+
+	use_link(ln);
+	return sink_write(ln->out, offset, data, len);
+}
+
+/*
+ * The end of the downloads of a link. Its pictures may still be
+ * committed by the writer thread: see ingest().
+ */
+static void link_end (struct link *ln, int status)
+{
+	use_link(ln);
+	if (ln->out != NULL) {
+		/* Released once its packets are written */
+		ln->out->done = out_abort;
+		writer_end(ln->out);
+	}
+	ln->out = cur_out = NULL;
+	fuji_engine_remove(cam);
+	reset_serial();
+	pthread_mutex_lock(&stats_lock);
+	ln->parked = 0;
+	ln->status = status;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void link_error (struct link *ln)
+{
+	fprintf(stderr, "%s%s\n", ln->tag, ln->ses->error);
+	link_end(ln, 1);
+}
+
+/* The frame number of a job, as camera_frame() */
+static int job_frame (struct link *ln, struct job *jb)
+{
+	int i, frame = jb->frame;
+
+	for (i = 0; i < ln->njobs; i++)
+		frame -= (ln->jobs[i].deleted == 1 && ln->jobs[i].frame < jb->frame);
+	return frame;
+}
+
+static void ingest_next (struct link *ln);
+
+/* In the writer thread: the picture of a job is written */
+static void ingest_commit (struct outfile *out)
+{
+	struct job *jb = out->arg;
+	struct link *ln = jb->link;
+	int ret;
+
+	ret = finish_picture(ln, out, jb->frame, jb->name, jb->size, jb->t0, jb->t1, jb->t2);
+	if (ret == 0)
+		verify_submit(jb->name, ln->tag, archive_dir ? ln->id : NULL, &jb->verified);
+	pthread_mutex_lock(&stats_lock);
+	jb->transferred = (ret == 0);
+	jb->committed = 1;
+	if (ret < 0)
+		ln->commit_error = 1;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * A picture is received: the writer thread completes it, after its
+ * packets, and the camera goes on with the next command meanwhile.
+ */
+static void download_done (struct fuji_session *ses, int result, void *arg)
+{
+	struct link *ln = arg;
+	struct job *jb = &ln->jobs[ln->next];
+	struct tms stms;
+
+	use_link(ln);
+	if (result < 0) {
+		link_error(ln);
+		return;
+	}
+	jb->t2 = times(&stms);
+	ln->out->done = ingest_commit;
+	ln->out->arg = jb;
+	writer_end(ln->out);
+	ln->out = cur_out = NULL;
+	ln->next++;
+	ingest_next(ln);
+}
+
+static void delete_done (struct fuji_session *ses, int result, void *arg)
+{
+	struct link *ln = arg;
+
+	if (result < 0) {
+		link_error(ln);
+		return;
+	}
+	if (!ses->answer[4]) {
+		ln->jobs[ln->deleting].deleted = 1;
+		ln->deleted++;
+	}
+	ingest_next(ln);
+}
+
+/*
+ * With "-d", submit the deletion of a picture downloaded and safely on
+ * the disk, if any. Returns 1 if there was one, 0 if none is ready, or
+ * -1 if none is left to wait for.
+ */
+static int delete_synced_job (struct link *ln)
+{
+	struct job *jb;
+	int i, n, ret, waiting = 0, committed, transferred;
+
+	for (i = ln->njobs - 1; i >= 0; i--) {
+		jb = &ln->jobs[i];
+		pthread_mutex_lock(&stats_lock);
+		committed = jb->committed;
+		transferred = jb->transferred;
+		pthread_mutex_unlock(&stats_lock);
+		if (i >= ln->next || jb->deleted)
+			continue;
+		if (!committed) {
+			waiting = 1;
+			continue;
+		}
+		if (!transferred)
+			continue;
+		ret = verify_poll(&jb->verified);
+		if (ret == VERIFY_PENDING) {
+			waiting = 1;
+			continue;
+		}
+		/* Not deleted twice, whatever the answer */
+		jb->deleted = -1;
+		if (ret != VERIFY_OK) {
+			printf("%s%s not verified, not deleted\n", ln->tag, jb->name);
+			continue;
+		}
+		n = job_frame(ln, jb);
+		ln->deleting = i;
+		ln->cmd[0] = 0; ln->cmd[1] = 0x19;
+		ln->cmd[2] = 2; ln->cmd[3] = 0;
+		ln->cmd[4] = n; ln->cmd[5] = n >> 8;
+		if (fuji_submit(cam, 6, ln->cmd, NULL, delete_done, ln) < 0)
+			link_error(ln);
+		return 1;
+	}
+	return waiting ? 0 : -1;
+}
+
+/*
+ * Submit the next command of a link: the download of its next picture,
+ * or with "-d" the deletion of one already downloaded and synced. The
+ * frame numbers of the next pictures take the deletions into account.
+ * The engine thread never waits: at the end of its queue, a link whose
+ * pictures are not all deleted yet is parked, and ingest() calls this
+ * again on the next tick.
+ */
+static void ingest_next (struct link *ln)
+{
+	struct job *jb;
+	struct tms stms;
+	int n, error, ret = -1;
+
+	use_link(ln);
+	pthread_mutex_lock(&stats_lock);
+	error = ln->commit_error;
+	ln->parked = 0;
+	pthread_mutex_unlock(&stats_lock);
+	if (error) {
+		link_end(ln, 1);
+		return;
+	}
+	if (delete_after && (ret = delete_synced_job(ln)) > 0)
+		return;
+	if (ln->next < ln->njobs) {
+		jb = &ln->jobs[ln->next];
+		if ((ln->out = pic_create(jb->name, jb->size)) == NULL) {
+			link_end(ln, 1);
+			return;
+		}
+		cur_out = ln->out;
+		ln->sink.write = ingest_write;
+		ln->sink.arg = ln;
+		jb->t0 = now();
+		jb->t1 = times(&stms);
+		n = job_frame(ln, jb);
+		ln->cmd[0] = 0; ln->cmd[1] = 0x02;
+		ln->cmd[2] = 2; ln->cmd[3] = 0;
+		ln->cmd[4] = n; ln->cmd[5] = n >> 8;
+		if (fuji_submit(cam, 6, ln->cmd, &ln->sink, download_done, ln) < 0)
+			link_error(ln);
+		return;
+	}
+	if (ret == 0) {
+		pthread_mutex_lock(&stats_lock);
+		ln->parked = 1;
+		pthread_mutex_unlock(&stats_lock);
+		return;
+	}
+	if (delete_after)
+		printf("%sDeleted %d picture(s).\n", ln->tag, ln->deleted);
+	link_end(ln, 0);
+}
+
+/* Try the parked links again. Returns the number there were */
+static int unpark (void)
+{
+	struct link *ln;
+	int n = 0, parked;
+
+	for (ln = links; ln < links + nlinks; ln++) {
+		pthread_mutex_lock(&stats_lock);
+		parked = ln->parked;
+		pthread_mutex_unlock(&stats_lock);
+		if (!parked)
+			continue;
+		n++;
+		if (interrupted) {
+			fprintf(stderr, "\n%sInterrupted!\n", ln->tag);
+			link_end(ln, 1);
+		} else
+			ingest_next(ln);
+	}
+	return n;
+}
+
+/*
+ * Download the pictures queued by the links. A single engine drives all
+ * the cameras, each going through its queue at its own pace, and the
+ * received packets go to one writer thread, which also completes the
+ * pictures: nothing the engine thread does waits for the disk.
+ */
+void ingest (double t0, double *tick)
+{
+	struct fuji_engine *eng;
+	struct link *ln;
+	struct job *jb;
+	int i, busy = 0, parked;
+
+	if ((eng = fuji_engine_new()) == NULL)
+		perror("Cannot create the engine");
+	else if (tar_fd < 0 && verify_start(MANIFEST_FILE, delete_after) < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", MANIFEST_FILE, strerror(errno));
+		fuji_engine_free(eng);
+		eng = NULL;
+	}
+	for (ln = links; ln < links + nlinks; ln++) {
+		if (!ln->queued)
+			continue;
+		use_link(ln);
+		if (eng == NULL)
+			link_end(ln, 1);
+		else if (fuji_engine_add(eng, cam) < 0)
+			link_error(ln);
 		else
-		  download_range(atoi(arg), atoi(arg), picnums, force);
+			ingest_next(ln);
+	}
+	while (eng != NULL && (busy = fuji_engine_run(eng, 200)) >= 0) {
+		progress_tick(t0, tick);
+		parked = unpark();
+		if (!busy && !parked)
+			break;
+	}
+	if (busy < 0) {
+		perror("epoll_wait");
+		for (ln = links; ln < links + nlinks; ln++)
+			if (ln->queued && ln->ses->engine != NULL)
+				link_end(ln, 1);
 	}
+	writer_stop();
+	fuji_engine_free(eng);
+	/* A link whose pictures are not all good has failed */
+	verify_sync();
+	for (ln = links; ln < links + nlinks; ln++)
+		for (i = 0; i < ln->njobs; i++) {
+			jb = &ln->jobs[i];
+			if (ln->status == 0 && (ln->commit_error
+			    || (jb->transferred && jb->verified != VERIFY_OK)))
+				ln->status = 1;
+		}
+}
+
+/*
+ * Drive all the links at the same time, one thread each, and print
+ * a combined summary. The downloads are done by ingest().
+ */
+int run_links (int argc, char **argv)
+{
+	struct link_args la[MAX_LINKS];
+	struct link *ln;
+	double t0, tick;
+	int i, status = 0, running;
+
+	if (argc && (!strcmp(argv[0], "preview") || !strcmp(argv[0], "live")
+	    || !strcmp(argv[0], "catalog"))) {
+		fprintf(stderr, "Cannot %s with several devices\n", argv[0]);
+		return 1;
+	}
+	t0 = tick = now();
+	ingest_mode = 1;
+	for (i = 0; i < nlinks; i++) {
+		ln = &links[i];
+		la[i].ln = ln;
+		la[i].argc = argc;
+		la[i].argv = argv;
+		ln->status = -1;
+		if (pthread_create(&ln->thread, NULL, link_thread, &la[i]) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	do {
+		usleep(200000);
+		progress_tick(t0, &tick);
+		running = 0;
+		pthread_mutex_lock(&stats_lock);
+		for (ln = links; ln < links + nlinks; ln++)
+			running += (ln->status < 0);
+		pthread_mutex_unlock(&stats_lock);
+	} while (running);
+	for (ln = links; ln < links + nlinks; ln++)
+		pthread_join(ln->thread, NULL);
+	ingest(t0, &tick);
+	for (ln = links; ln < links + nlinks; ln++)
+		if (ln->status > status)
+			status = ln->status;
+	printf("Summary:\n");
+	print_progress(1, now() - t0);
+	return status;
+}
+
+/*
+ * Open the archive of "-T". On standard output, the messages usually
+ * printed there go to standard error instead.
+ */
+int open_tar (void)
+{
 	if (delete_after) {
-		sync();
-		deleted = 0;
-		for (c = pictures; c > 0; c--)
-			if (pinfo[c].transferred)
-				deleted += !del_frame(c);
-		printf("Deleted %d picture(s).\n", deleted);
+		fprintf(stderr, "Cannot delete the pictures of an archive (-d and -T)\n");
+		return -1;
+	}
+	if (strcmp(tar_path, "-"))
+		tar_fd = open(tar_path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	else if (isatty(1)) {
+		fprintf(stderr, "Not writing an archive to a terminal\n");
+		return -1;
+	} else if ((tar_fd = dup(1)) >= 0)
+		dup2(2, 1);
+	if (tar_fd < 0) {
+		fprintf(stderr, "Cannot create %s: %s\n", tar_path, strerror(errno));
+		return -1;
 	}
 	return 0;
 }
+
+int main (int argc, char **argv)
+{
+	extern char *optarg;
+	extern int optind, opterr, optopt;
+
+	int c, status;
+	long n;
+	struct sigaction s2act;
+	mode_t mask;
+
+	s2act.sa_handler = sigint_handler;
+	sigemptyset(&s2act.sa_mask); s2act.sa_flags = 0;
+	sigaction(SIGINT, &s2act, NULL);
+	s2act.sa_handler = sigusr1_handler;
+	sigaction(SIGUSR1, &s2act, NULL);
+
+	/* Command line parsing */
+	while ((c = getopt(argc,argv,"A:B:CD:Ll7dfho:ptviS:T:W:")) != EOF)
+	switch(c) {
+		case 'A':
+			archive_dir = optarg;
+			break;
+		case 'B':
+			desired_speed = atoi(optarg);
+			break;
+		case 'C':
+			use_cache = 0;
+			break;
+		case 'D':
+			add_link(optarg);
+			break;
+		case 'L':
+			list_command_set = 1;
+			break;
+		case 'l':
+			low_latency = 1;
+			break;
+		case '7':
+			ds7_compat = 1;
+			break;
+		case 'd':
+			delete_after = 1;
+			break;
+		case 'f':
+			force = 1;
+			break;
+		case 'p':
+			picnums = 1;
+			break;
+		case 't':
+			thumbnails = 1;
+			break;
+		case 'o':
+			if ((preview_fmt = preview_format(optarg)) < 0) {
+				fprintf(stderr, "Unknown preview format %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'h':
+			printf(Usage);
+			return 0;
+		case 'v':
+			printf(Copyright);
+			return 0;
+		case 'i':
+			info = 1;
+			break;
+		case 'S':
+			stats_file = optarg;
+			atexit(write_stats);
+			break;
+		case 'T':
+			tar_path = optarg;
+			break;
+		case 'W':
+			capture_path = optarg;
+			break;
+		default:
+			fprintf(stderr, Usage);
+			return 1;
+	}
+	if (nlinks == 0)
+		add_link(DEFAULT_DEVICE);
+	mask = umask(0);
+	umask(mask);
+	file_mode = 0666 & ~mask;
+	if (archive_dir && (n = archive_open(archive_dir)) < 0) {
+		fprintf(stderr, "Cannot open the archive %s: %s\n", archive_dir,
+			errno == EINVAL ? "bad index" : strerror(errno));
+		return 1;
+	}
+	if (archive_dir && info)
+		fprintf(stderr, "%ld pictures in the archive.\n", n);
+	if (tar_path && open_tar() < 0)
+		return 1;
+	if (nlinks == 1) {
+		links[0].tag[0] = '\0';
+		status = run_link(&links[0], argc - optind, argv + optind);
+	} else
+		status = run_links(argc - optind, argv + optind);
+	if (tar_fd >= 0 && tar_finish() < 0)
+		status = 1;
+	return status;
+}
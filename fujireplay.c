@@ -0,0 +1,371 @@
+/*
+ * Offline analysis of the captures written by "fujiplay -W". The bytes
+ * of each direction go through the frame decoder of fujiplay (frame.c),
+ * as they were read on the line, and the exchanges are reconstructed:
+ * commands, ACKs and NAKs, answer frames with their checksum result,
+ * timeouts of the host, and the time between each step. Long silences
+ * are flagged, and a summary per command is printed at the end.
+ *
+ * With "-b N", the received data is also decoded N times in a row, in
+ * the chunks it was read in, to benchmark the decoder.
+ *
+ * Written for fujiplay and released in the public domain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include "frame.h"
+#include "capture.h"
+#include "stats.h"
+
+#define PACKET_MAX	5000
+
+/* One direction of the link */
+struct stream {
+	const char *arrow;	/* "<" camera to host, ">" host to camera */
+	int parmrk;
+	int in_frame;
+	int esc;		/* PARMRK escape, between frames */
+	int garbage;		/* stray bytes, not reported yet */
+	struct frame_decoder dec;
+	unsigned char buf[PACKET_MAX];
+};
+
+/* The exchange in progress */
+struct exchange {
+	int op;			/* -1 if none */
+	long long start_us, last_us;
+	int frames, retries;
+	int len;		/* the command frame, to recognize a resend */
+	unsigned char cmd[PACKET_MAX];
+};
+
+struct op_summary {
+	long calls, retries, frames;
+	long long total_us, max_us;
+};
+
+static const char *frame_errors[] = {
+	"incomplete", "syntax error", "parity error", "too long", "checksum error" };
+
+struct stream camera = { "<", 1 }, host_stream = { ">", 0 };
+int quiet = 0;
+long long gap_us = 500000;
+struct exchange ex = { -1 };
+struct op_summary ops[256];
+long frames_ok[2], frames_bad[2], naks[2], timeouts, garbage_bytes;
+long long longest_gap, longest_gap_at;
+
+#ifdef __GNUC__
+static void event (long long t, const char *arrow, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+#endif
+
+static void event (long long t, const char *arrow, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (quiet)
+		return;
+	printf("%12.6f  %s  ", t / 1e6, arrow);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	if (ex.op >= 0 && t > ex.last_us)
+		printf("  (+%.1f ms)", (t - ex.last_us) / 1e3);
+	putchar('\n');
+}
+
+static void end_exchange (long long t)
+{
+	struct op_summary *o;
+
+	if (ex.op < 0)
+		return;
+	o = &ops[ex.op];
+	o->calls++;
+	o->retries += ex.retries;
+	o->frames += ex.frames;
+	o->total_us += t - ex.start_us;
+	if (t - ex.start_us > o->max_us)
+		o->max_us = t - ex.start_us;
+	if (!quiet)
+		printf("%12.6f     command %02x done in %.1f ms, %d frame(s), %d retries\n",
+			t / 1e6, ex.op, (t - ex.start_us) / 1e3, ex.frames, ex.retries);
+	ex.op = -1;
+}
+
+static void flush_garbage (struct stream *s, long long t)
+{
+	if (s->garbage) {
+		event(t, s->arrow, "%d stray byte(s)", s->garbage);
+		garbage_bytes += s->garbage;
+		s->garbage = 0;
+	}
+}
+
+/* A complete (or bad) frame */
+static void frame_event (struct stream *s, long long t)
+{
+	struct frame_decoder *d = &s->dec;
+	int host = (s == &host_stream);
+	int op;
+
+	if (d->status == FRAME_BAD) {
+		frames_bad[host]++;
+		event(t, s->arrow, "frame, %s after %d bytes", frame_errors[d->error], d->len);
+		return;
+	}
+	frames_ok[host]++;
+	op = (d->len >= 2) ? d->buf[1] : 0;
+	if (host) {
+		/* The same command again is a retry */
+		if (ex.op >= 0 && ex.frames == 0 && d->len == ex.len
+		    && !memcmp(d->buf, ex.cmd, d->len))
+			ex.retries++;
+		else {
+			end_exchange(t);
+			ex.op = op;
+			ex.start_us = t;
+			ex.frames = ex.retries = 0;
+			ex.len = d->len;
+			memcpy(ex.cmd, d->buf, d->len);
+		}
+		event(t, s->arrow, "command %02x, %d bytes%s", op, d->len - 4,
+			d->last ? "" : ", more follows");
+	} else {
+		ex.frames++;
+		event(t, s->arrow, "answer, %d bytes%s", d->len - 4,
+			d->last ? ", last" : "");
+	}
+	ex.last_us = t;
+}
+
+/* Single control bytes */
+static void byte_event (struct stream *s, long long t, int c)
+{
+	int host = (s == &host_stream);
+
+	switch (c) {
+	  case ACK:
+		event(t, s->arrow, "ACK");
+		/* The host acknowledges the last answer frame */
+		if (host && ex.op >= 0 && ex.frames && !camera.in_frame
+		    && camera.dec.status == FRAME_DONE && camera.dec.last)
+			end_exchange(t);
+		break;
+	  case NAK:
+		naks[host]++;
+		if (ex.op >= 0)
+			ex.retries++;
+		event(t, s->arrow, "NAK");
+		break;
+	  case ENQ:
+		event(t, s->arrow, "ENQ");
+		break;
+	  case EOT:
+		event(t, s->arrow, "EOT");
+		break;
+	  default:
+		s->garbage++;
+		return;
+	}
+	ex.last_us = t;
+}
+
+static void feed (struct stream *s, long long t, const unsigned char *p, int n)
+{
+	int used, c;
+
+	while (n > 0) {
+		if (s->in_frame) {
+			used = frame_decode(&s->dec, p, n);
+			p += used;
+			n -= used;
+			if (s->dec.status != FRAME_MORE) {
+				s->in_frame = 0;
+				frame_event(s, t);
+			}
+			continue;
+		}
+		c = *p++;
+		n--;
+		if (s->esc) {
+			/* 0xFF 0xFF is 0xFF, 0xFF 0x00 X a parity error on X */
+			if (s->esc == 1 && c == 0) {
+				s->esc = 2;
+				continue;
+			}
+			s->esc = 0;
+			s->garbage++;
+			continue;
+		}
+		if (s->parmrk && c == 0xFF) {
+			s->esc = 1;
+			continue;
+		}
+		if (c == DLE) {
+			flush_garbage(s, t);
+			frame_decoder_init(&s->dec, s->buf, sizeof(s->buf) - 1, s->parmrk);
+			s->in_frame = 1;
+			frame_decode(&s->dec, p - 1, 1);
+			continue;
+		}
+		flush_garbage(s, t);
+		byte_event(s, t, c);
+	}
+}
+
+/* The host gave up waiting: it drops any partial frame */
+static void host_timeout (struct stream *s, long long t, long ms)
+{
+	timeouts++;
+	if (s->in_frame) {
+		s->in_frame = 0;
+		s->dec.status = FRAME_BAD;
+		s->dec.error = 0;
+		frame_event(s, t);
+	}
+	flush_garbage(s, t);
+	event(t, ">", "timeout (%ld ms)", ms);
+	ex.last_us = t;
+}
+
+static void summary (long long end)
+{
+	struct op_summary *o;
+	int op;
+
+	printf("\nDuration %.3f s; frames received %ld (%ld bad), sent %ld (%ld bad)\n",
+		end / 1e6, frames_ok[0] + frames_bad[0], frames_bad[0],
+		frames_ok[1] + frames_bad[1], frames_bad[1]);
+	printf("NAKs from the camera %ld, from the host %ld; host timeouts %ld; "
+		"stray bytes %ld\n", naks[0], naks[1], timeouts, garbage_bytes);
+	printf("Longest silence %.1f ms, at %.6f\n",
+		longest_gap / 1e3, longest_gap_at / 1e6);
+	printf("\n op   calls  retries   frames    avg ms    max ms\n");
+	for (op = 0; op < 256; op++) {
+		o = &ops[op];
+		if (o->calls)
+			printf(" %02x %7ld  %7ld  %7ld  %8.1f  %8.1f\n", op, o->calls,
+				o->retries, o->frames, o->total_us / 1e3 / o->calls,
+				o->max_us / 1e3);
+	}
+}
+
+/* Decode the received chunks "n" times, and report the speed */
+static void benchmark (struct capture_rec *chunks, int nchunks, int n)
+{
+	static struct stream s;
+	long long t0, t;
+	long bytes = 0;
+	int i, k;
+
+	quiet = 1;
+	t0 = stats_usec();
+	for (k = 0; k < n; k++) {
+		memset(&s, 0, sizeof(s));
+		s.arrow = "<";
+		s.parmrk = 1;
+		for (i = 0; i < nchunks; i++) {
+			feed(&s, 0, chunks[i].data, chunks[i].len);
+			bytes += chunks[i].len;
+		}
+	}
+	t = stats_usec() - t0;
+	if (t <= 0)
+		t = 1;
+	printf("\nDecoder: %ld bytes in %.3f s, %.1f MB/s\n", bytes, t / 1e6,
+		bytes / (double) t);
+}
+
+int main (int argc, char **argv)
+{
+	struct capture_rec rec, *chunks = NULL;
+	long long start, last = 0;
+	int c, ret, bench = 0, nchunks = 0, maxchunks = 0;
+	FILE *fd;
+
+	while ((c = getopt(argc, argv, "qg:b:")) != EOF)
+	switch (c) {
+		case 'q':
+			quiet = 1;
+			break;
+		case 'g':
+			gap_us = atof(optarg) * 1000;
+			break;
+		case 'b':
+			bench = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: fujireplay [-q] [-g MS] [-b N] CAPTURE\n"
+				"  -q	Only print the summary\n"
+				"  -g MS	Flag silences longer than MS milliseconds (default 500)\n"
+				"  -b N	Decode the received data N times, and time it\n");
+			return 1;
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: fujireplay [-q] [-g MS] [-b N] CAPTURE\n");
+		return 1;
+	}
+	if ((fd = capture_open(argv[optind], &start)) == NULL) {
+		fprintf(stderr, "Cannot read capture %s: %s\n", argv[optind],
+			errno == EINVAL ? "not a capture file" : strerror(errno));
+		return 1;
+	}
+	memset(&rec, 0, sizeof(rec));
+	while ((ret = capture_read(fd, &rec)) > 0) {
+		if (rec.type != CAPTURE_SPEED) {
+			if (rec.time_us - last > longest_gap) {
+				longest_gap = rec.time_us - last;
+				longest_gap_at = last;
+			}
+			if (rec.time_us - last >= gap_us && !quiet)
+				printf("------------  %.1f ms without traffic\n",
+					(rec.time_us - last) / 1e3);
+			last = rec.time_us;
+		}
+		switch (rec.type) {
+		  case CAPTURE_IN:
+			feed(&camera, rec.time_us, rec.data, rec.len);
+			if (bench) {
+				if (nchunks == maxchunks) {
+					maxchunks = maxchunks ? 2*maxchunks : 1024;
+					chunks = realloc(chunks, maxchunks * sizeof(*chunks));
+					if (chunks == NULL) {
+						perror("realloc");
+						return 1;
+					}
+				}
+				chunks[nchunks].len = rec.len;
+				chunks[nchunks].data = malloc(rec.len);
+				if (chunks[nchunks].data == NULL) {
+					perror("malloc");
+					return 1;
+				}
+				memcpy(chunks[nchunks++].data, rec.data, rec.len);
+			}
+			break;
+		  case CAPTURE_OUT:
+			feed(&host_stream, rec.time_us, rec.data, rec.len);
+			break;
+		  case CAPTURE_SPEED:
+			event(rec.time_us, " ", "line speed %ld bps", capture_int(&rec));
+			break;
+		  case CAPTURE_TIMEOUT:
+			host_timeout(&camera, rec.time_us, capture_int(&rec));
+			break;
+		}
+	}
+	if (ret < 0)
+		fprintf(stderr, "Capture %s is truncated or corrupt\n", argv[optind]);
+	end_exchange(rec.time_us);
+	summary(rec.time_us);
+	if (bench)
+		benchmark(chunks, nchunks, bench);
+	return ret < 0;
+}
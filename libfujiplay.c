@@ -0,0 +1,1459 @@
+/*
+ * libfujiplay: the serial protocol of the Fujifilm digital cameras.
+ * See libfujiplay.h.
+ *
+ * Written by Thierry Bousch <bousch@topo.math.u-psud.fr>
+ * and released in the public domain.
+ */
+
+#define _GNU_SOURCE	/* ppoll() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#include "libfujiplay.h"
+
+#if !defined(B57600) && defined(EXTA)
+#define B57600 EXTA
+#endif
+
+#if !defined(B115200) && defined(EXTB)
+#define B115200 EXTB
+#endif
+
+#define DRAIN_MS	20
+#define BYTE_TIMEOUT	100	/* ms, between the bytes of a frame */
+#define ENQ_TIMEOUT	100	/* ms, for the ACK of an ENQ */
+#define UPLOAD_CHUNK	512
+
+/*
+ * Low-latency mode: a frame is over, or the line idle, after a silence
+ * of a few character times rather than BYTE_TIMEOUT or DRAIN_MS. The
+ * UART delivers the bytes by FIFO fulls (up to 16 characters, then 4
+ * of idle line); unless the driver accepts its low-latency setting, the
+ * USB adapters may also hold them for their latency timer (16 ms).
+ */
+#define GAP_CHARS		20
+#define GAP_SLACK_US		5000
+#define GAP_SLACK_USB_US	16000
+
+struct baudrate_info {
+	int number;
+	int posix_speed;
+	int speed;
+};
+
+static const struct baudrate_info brinfo[] = {
+#ifdef B115200
+	{ 8, B115200, 115200 },
+#endif
+#ifdef B57600
+	{ 7,  B57600,  57600 },
+#endif
+	{ 6,  B38400,  38400 },
+	{ 4,  B19200,  19200 },
+	{ 0,   B9600,   9600 }
+};
+
+struct fuji_engine {
+	int epfd;
+	int busy;		/* sessions with a command submitted */
+};
+
+static const char *errors[] = {
+	"no error", "cannot open the device", "the camera does not respond",
+	"command not acknowledged", "answer not received", "interrupted",
+	"cannot store the data", "refused by the camera", "busy" };
+
+#ifdef __GNUC__
+static int fail (struct fuji_session *ses, int err, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+static void say (struct fuji_session *ses, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+#endif
+
+/* Leave the message of error "err" in the session, and return it */
+static int fail (struct fuji_session *ses, int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(ses->error, sizeof(ses->error), fmt, ap);
+	va_end(ap);
+	return err;
+}
+
+/* Pass a message to the caller, if it wants them */
+static void say (struct fuji_session *ses, const char *fmt, ...)
+{
+	char msg[128];
+	va_list ap;
+
+	if (ses->log == NULL)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	ses->log(ses, msg);
+}
+
+const char *fuji_strerror (int err)
+{
+	if (err > 0 || -err >= sizeof(errors) / sizeof(errors[0]))
+		return "unknown error";
+	return errors[-err];
+}
+
+struct fuji_session *fuji_new (void)
+{
+	struct fuji_session *ses;
+
+	if ((ses = calloc(1, sizeof(struct fuji_session))) == NULL)
+		return NULL;
+	ses->fd = -1;
+	ses->timerfd = -1;
+	ses->line_speed = 9600;
+	memset(ses->profile.info, 0xff, sizeof(ses->profile.info));
+	stats_init(&ses->stats);
+	return ses;
+}
+
+void fuji_free (struct fuji_session *ses)
+{
+	if (ses == NULL)
+		return;
+	fuji_close(ses);
+	free(ses);
+}
+
+/*
+ * Read what the line has brought, if the receive buffer is empty.
+ * Returns the number of bytes available, 0 if there's nothing to read
+ * (the device is non-blocking, with VMIN = VTIME = 0), or -1 on error.
+ */
+static int fill_input (struct fuji_session *ses)
+{
+	int ret;
+
+	while (!ses->pending_input) {
+		ret = read(ses->fd, ses->rx_buffer, FUJI_RX_BUFSIZE);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN) ? 0 : -1;
+		}
+		if (ret == 0)
+			return 0;
+		ses->pending_input = ret;
+		ses->rx_start = ses->rx_buffer;
+		ses->stats.bytes_in += ret;
+		if (ses->capture)
+			capture_record(ses->capture, CAPTURE_IN, ses->rx_buffer, ret);
+	}
+	return ses->pending_input;
+}
+
+/* Wait up to "usecs" microseconds for some input */
+static int wait_for_input (struct fuji_session *ses, long long usecs)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	long long t0, end;
+	int ret;
+
+	if (ses->pending_input)
+		return 1;
+	if (usecs <= 0)
+		return 0;
+
+	pfd.fd = ses->fd;
+	pfd.events = POLLIN;
+	t0 = stats_usec();
+	end = t0 + usecs;
+	do {
+		ts.tv_sec = usecs / 1000000;
+		ts.tv_nsec = (usecs % 1000000) * 1000;
+		ret = ppoll(&pfd, 1, &ts, NULL);
+		usecs = end - stats_usec();
+	} while (ret < 0 && errno == EINTR && usecs > 0);
+	ses->stats.idle_us += stats_usec() - t0;
+	if (ret > 0 && !(pfd.revents & POLLIN)) {
+		errno = EIO;	/* hung up */
+		return -1;
+	}
+	return (ret < 0 && errno == EINTR) ? 0 : ret;
+}
+
+/* Get a byte, waiting up to "usecs" for it; -1 if none */
+static int get_raw_byte (struct fuji_session *ses, long long usecs)
+{
+	if (!ses->pending_input
+	    && (wait_for_input(ses, usecs) <= 0 || fill_input(ses) <= 0))
+		return -1;
+	ses->pending_input--;
+	return *ses->rx_start++;
+}
+
+static int get_byte (struct fuji_session *ses, long long usecs)
+{
+	int c;
+
+	c = get_raw_byte(ses, usecs);
+	if (c < 255)
+		return c;
+	c = get_raw_byte(ses, ses->gap_us);
+	if (c == 255)
+		return c;	/* escaped '\377' */
+	if (c != 0)
+		say(ses, "get_byte: impossible escape sequence following 0xFF");
+	/* Otherwise, it's a parity or framing error */
+	get_raw_byte(ses, ses->gap_us);
+	ses->stats.parity_errors++;
+	return -1;
+}
+
+/*
+ * The silence after which a frame is incomplete: BYTE_TIMEOUT, as with
+ * VTIME = 1, or in low-latency mode a few character times at the line
+ * speed. The line is idle after DRAIN_MS, or the same silence.
+ */
+static void set_gaps (struct fuji_session *ses)
+{
+	if (!ses->low_latency) {
+		ses->gap_us = 1000 * BYTE_TIMEOUT;
+		ses->drain_us = 1000 * DRAIN_MS;
+		return;
+	}
+	ses->gap_us = 11000000LL * GAP_CHARS / ses->line_speed
+		+ (ses->ll_driver ? GAP_SLACK_US : GAP_SLACK_USB_US);
+	ses->drain_us = ses->gap_us;
+}
+
+/* Throw away the input, until the line is idle */
+static void drain_input (struct fuji_session *ses)
+{
+	while (get_byte(ses, ses->drain_us) >= 0 || ses->pending_input)
+		continue;
+}
+
+static int put_bytes (struct fuji_session *ses, int n, const unsigned char *buff)
+{
+	struct pollfd pfd;
+	int ret;
+
+	while (n > 0) {
+		ret = write(ses->fd, buff, n);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return -1;
+			/* The output queue is full */
+			pfd.fd = ses->fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, 1000) == 0)
+				return -1;
+			continue;
+		}
+		if (ses->capture)
+			capture_record(ses->capture, CAPTURE_OUT, buff, ret);
+		n -= ret;
+		buff += ret;
+		ses->stats.bytes_out += ret;
+	}
+	return 0;
+}
+
+static int put_byte (struct fuji_session *ses, int c)
+{
+	unsigned char buff[1];
+
+	buff[0] = c;
+	return put_bytes(ses, 1, buff);
+}
+
+/*
+ * Wake the camera up. Returns -1 if it doesn't answer. In low-latency
+ * mode, it is pinged for as long as three ENQs would take, even if it
+ * answers garbage: after a speed change, that's until it has switched.
+ */
+static int ping_camera (struct fuji_session *ses)
+{
+	long long end = stats_usec() + 3000LL * ENQ_TIMEOUT;
+	int i, c;
+
+	drain_input(ses);
+	for (i = 0; i < 3 || (ses->low_latency && stats_usec() < end); i++) {
+		put_byte(ses, ENQ);
+		if ((c = get_byte(ses, 1000LL * ENQ_TIMEOUT)) == ACK)
+			return 0;
+		if (c >= 0 && ses->low_latency)
+			drain_input(ses);
+	}
+	return -1;
+}
+
+static int attention (struct fuji_session *ses)
+{
+	if (ping_camera(ses) == 0)
+		return 0;
+	return fail(ses, FUJI_ERR_NORESP, "The camera does not respond.");
+}
+
+/*
+ * Timeouts. Each exchange of a command has its own response time: the
+ * acknowledgement of the command (RTT_ACK), its first answer packet
+ * (RTT_ANSWER), which comes after the camera has done its job, and the
+ * following packets (RTT_NEXT). They are measured as we go, and the
+ * timeouts follow them, so that a lost frame is noticed in a few tens
+ * of milliseconds. Until the first measure, the timeout is based on
+ * what the camera says the command can take (0x51), or on fixed values;
+ * the acknowledgements and following packets don't depend much on the
+ * command, so the measures of the other commands (rtt[256]) are used.
+ */
+#define RTT_ACK		0
+#define RTT_ANSWER	1
+#define RTT_NEXT	2
+
+/* Longest time a command may take, in milliseconds */
+static int max_timeout (struct fuji_session *ses, int op)
+{
+	if (ses->profile.info[op] >= 0)
+		return 100 * ses->profile.info[op] + 200;
+	switch (op) {
+	  case 0x27:	/* Take picture */
+	  case 0x34:	/* Recharge the flash */
+	  case 0x64:	/* Take preview */
+	    return 12000;
+	  case 0x0b:	/* Count pictures */
+	  case 0x19:    /* Erase a picture */
+	    return 2000;
+	}
+	return 1000;
+}
+
+/* Timeout for an exchange, sending "len" bytes, after "retry" failures */
+static int cmd_timeout (struct fuji_session *ses, int op, int phase, int len, int retry)
+{
+	struct fuji_rtt *r = &ses->rtt[op][phase];
+	int limit = max_timeout(ses, op), t;
+
+	if (!r->samples && phase != RTT_ANSWER)
+		r = &ses->rtt[256][phase];
+	if (!r->samples)
+		return limit;
+	t = 1000 * (r->srtt + 4 * r->rttvar + 10.0 * (len+6) / ses->line_speed) + 50;
+	t <<= retry;
+	return (t < limit) ? t : limit;
+}
+
+static void rtt_update (struct fuji_rtt *r, double m)
+{
+	double err;
+
+	if (!r->samples++) {
+		r->srtt = m;
+		r->rttvar = m / 2;
+		return;
+	}
+	err = m - r->srtt;
+	r->srtt += err / 8;
+	if (err < 0)
+		err = -err;
+	r->rttvar += (err - r->rttvar) / 4;
+}
+
+/*
+ * The exchanges are state machines, driven by the input and by their
+ * deadline: the blocking calls run them to completion with poll(), and
+ * the engine runs those of many sessions at once, with epoll and a
+ * timerfd per session.
+ *
+ *   ST_ACK	the frame is sent, waiting for its ACK (a NAK or a timeout
+ *		means sending it again)
+ *   ST_PACKET	waiting for an answer packet, which is ACKed (NAKed if
+ *		it's bad or doesn't come), until the last one
+ *   ST_DRAIN	throwing away a garbled reply, until the line is idle
+ *
+ * Commands (EX_COMMAND) go through ST_ACK then ST_PACKET; the data frames
+ * of uploads (EX_FRAME) are only acknowledged.
+ */
+#define ST_IDLE		0
+#define ST_ACK		1
+#define ST_PACKET	2
+#define ST_DRAIN	3
+
+#define EX_COMMAND	0
+#define EX_FRAME	1
+
+/* Set the deadline of the exchange (0 for none), and arm the timer */
+static void set_deadline (struct fuji_session *ses, long long t)
+{
+	struct itimerspec its;
+
+	ses->deadline = t;
+	if (ses->timerfd < 0)
+		return;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = t / 1000000;
+	its.it_value.tv_nsec = (t % 1000000) * 1000;
+	timerfd_settime(ses->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Wait for the reply to the current step, within its timeout */
+static void wait_for (struct fuji_session *ses, int phase, int len)
+{
+	struct fuji_exchange *ex = &ses->ex;
+
+	ex->waiting = 1;
+	ex->wait_phase = phase;
+	ex->wait_ms = cmd_timeout(ses, ex->op, phase, len, ex->retry);
+	ex->wait_start = stats_usec();
+	set_deadline(ses, ex->wait_start + 1000LL * ex->wait_ms);
+}
+
+/* The reply has begun to come: measure it, unless after a failure */
+static void got_reply (struct fuji_session *ses)
+{
+	struct fuji_exchange *ex = &ses->ex;
+	long long t = stats_usec() - ex->wait_start;
+
+	ex->waiting = 0;
+	ses->stats.ops[ex->op].wait_us[ex->wait_phase] += t;
+	if (!ex->retry) {
+		rtt_update(&ses->rtt[ex->op][ex->wait_phase], t / 1e6);
+		rtt_update(&ses->rtt[256][ex->wait_phase], t / 1e6);
+	}
+}
+
+/* Nothing came in time */
+static void timed_out (struct fuji_session *ses)
+{
+	struct fuji_exchange *ex = &ses->ex;
+
+	ex->waiting = 0;
+	ses->stats.ops[ex->op].wait_us[ex->wait_phase] += stats_usec() - ex->wait_start;
+	ses->stats.timeouts++;
+	if (ses->capture)
+		capture_record_int(ses->capture, CAPTURE_TIMEOUT, ex->wait_ms);
+}
+
+static void send_frame (struct fuji_session *ses)
+{
+	/* The whole frame goes out with a single write() */
+	ses->stats.frames_out++;
+	put_bytes(ses, ses->ex.flen, ses->ex.frame);
+}
+
+/* Start the exchange set up in ses->ex */
+static void begin (struct fuji_session *ses)
+{
+	struct fuji_exchange *ex = &ses->ex;
+
+	/* The camera only speaks when spoken to: what's left is stale */
+	ses->pending_input = 0;
+	ex->retry = 0;
+	ex->phase = RTT_ANSWER;
+	ex->offset = 0;
+	ex->t0 = stats_usec();
+	ses->stats.ops[ex->op].bytes_out += ex->len;
+	ses->state = ST_ACK;
+	send_frame(ses);
+	wait_for(ses, RTT_ACK, ex->len);
+}
+
+/* The end of the exchange, with its result (or error code) */
+static void complete (struct fuji_session *ses, int result)
+{
+	struct fuji_exchange *ex = &ses->ex;
+	void (*done) (struct fuji_session *, int, void *);
+
+	ses->state = ST_IDLE;
+	set_deadline(ses, 0);
+	if (result >= 0)
+		stats_command(&ses->stats, ex->op, stats_usec() - ex->t0);
+	if (ses->prelude) {
+		/* The 0x51 query before a command: now the command itself */
+		ses->prelude = 0;
+		if (result >= 0) {
+			ses->profile.info[ses->next.op] = ses->answer[4] + (ses->answer[5] << 8);
+			ses->profile.changed = 1;
+			ses->ex = ses->next;
+			begin(ses);
+			return;
+		}
+	}
+	ses->result = result;
+	if (ses->async) {
+		ses->async = 0;
+		ses->engine->busy--;
+		done = ses->done;
+		ses->done = NULL;
+		if (done)
+			done(ses, result, ses->done_arg);
+	}
+}
+
+static void start_packet (struct fuji_session *ses)
+{
+	/* Keep room for the sentry */
+	frame_decoder_init(&ses->dec, ses->answer, sizeof(ses->answer) - 1, 1);
+	ses->state = ST_PACKET;
+	wait_for(ses, ses->ex.phase, 0);
+}
+
+/* Throw the input away until the line is idle, then go on from "from" */
+static void start_drain (struct fuji_session *ses, int from)
+{
+	ses->drain_from = from;
+	ses->state = ST_DRAIN;
+	ses->rx_start += ses->pending_input;
+	ses->pending_input = 0;
+	set_deadline(ses, stats_usec() + ses->drain_us);
+}
+
+static void ack_failed (struct fuji_session *ses, int c)
+{
+	struct fuji_exchange *ex = &ses->ex;
+
+	if (++ex->retry == 3) {
+		if (ex->kind == EX_FRAME)
+			complete(ses, fail(ses, FUJI_ERR_SEND,
+				"Cannot send data (cmd=%02x), aborting.", ex->op));
+		else
+			complete(ses, fail(ses, FUJI_ERR_SEND,
+				"Cannot issue command %02x, aborting.", ex->op));
+		return;
+	}
+	ses->stats.ops[ex->op].retries++;
+	ses->stats.naks_in += (c == NAK);
+	if ((c == NAK && ex->kind == EX_COMMAND) || c < 0) {
+		send_frame(ses);
+		wait_for(ses, RTT_ACK, ex->len);
+	} else {
+		/* Garbled answer? Throw it away first */
+		start_drain(ses, ST_ACK);
+	}
+}
+
+static void packet_failed (struct fuji_session *ses)
+{
+	struct fuji_exchange *ex = &ses->ex;
+
+	if (++ex->retry == 3) {
+		complete(ses, fail(ses, FUJI_ERR_RECV,
+			"Cannot receive answer (cmd=%02x), aborting.", ex->op));
+		return;
+	}
+	ses->stats.ops[ex->op].retries++;
+	ses->stats.naks_out++;
+	put_byte(ses, NAK);
+	start_packet(ses);
+}
+
+static void drain_done (struct fuji_session *ses)
+{
+	struct fuji_exchange *ex = &ses->ex;
+
+	if (ses->drain_from == ST_PACKET) {
+		packet_failed(ses);
+		return;
+	}
+	/* Ask for the ACK again; data frames are simply sent again */
+	if (ex->kind == EX_FRAME)
+		send_frame(ses);
+	else {
+		ses->stats.naks_out++;
+		put_byte(ses, NAK);
+	}
+	ses->state = ST_ACK;
+	wait_for(ses, RTT_ACK, ex->len);
+}
+
+/* A complete (or bad) answer packet */
+static void packet_done (struct fuji_session *ses)
+{
+	struct frame_decoder *dec = &ses->dec;
+	struct fuji_exchange *ex = &ses->ex;
+	struct fuji_sink *sink = ex->sink;
+	int more;
+
+	if (dec->status == FRAME_BAD) {
+		ses->stats.frame_errors[dec->error]++;
+		start_drain(ses, ST_PACKET);
+		return;
+	}
+	/* Append a sentry '\0' at the end of the buffer, for the convenience
+	   of C programmers */
+	ses->answer[dec->len] = '\0';
+	ses->answer_len = dec->len;
+	if (dec->len < 4 || ses->answer[2] + (ses->answer[3]<<8) != dec->len - 4) {
+		ses->stats.frame_errors[STATS_ERR_LENGTH]++;
+		packet_failed(ses);
+		return;
+	}
+	ses->stats.frames_in++;
+	ses->stats.ops[ex->op].bytes_in += dec->len;
+	ex->retry = 0;
+	ex->phase = RTT_NEXT;
+	more = !dec->last;
+	if (more && ses->interrupted && *ses->interrupted) {
+		complete(ses, fail(ses, FUJI_ERR_INTR, "Interrupted!"));
+		return;
+	}
+	put_byte(ses, ACK);
+	if (sink != NULL && sink->write(sink->arg, ex->offset, ses->answer+4,
+					ses->answer_len-4) < 0) {
+		complete(ses, fail(ses, FUJI_ERR_SINK,
+			"Cannot store the answer (cmd=%02x): %s", ex->op, strerror(errno)));
+		return;
+	}
+	ex->offset += ses->answer_len - 4;
+	if (more)
+		start_packet(ses);
+	else
+		complete(ses, ex->offset);
+}
+
+/* Consume the pending input, as far as the current state goes */
+static void step (struct fuji_session *ses)
+{
+	struct fuji_exchange *ex = &ses->ex;
+	int c, used;
+
+	switch (ses->state) {
+	  case ST_ACK:
+		if (ex->waiting)
+			got_reply(ses);
+		c = *ses->rx_start++;
+		ses->pending_input--;
+		if (c == ACK) {
+			if (ex->kind == EX_FRAME)
+				complete(ses, 0);
+			else {
+				ex->retry = 0;
+				start_packet(ses);
+			}
+		} else {
+			/* 0xFF 0x00 is the mark of a parity error */
+			if (c == 0xFF && ses->pending_input && *ses->rx_start == 0)
+				ses->stats.parity_errors++;
+			ack_failed(ses, c);
+		}
+		break;
+	  case ST_PACKET:
+		if (ex->waiting)
+			got_reply(ses);
+		used = frame_decode(&ses->dec, ses->rx_start, ses->pending_input);
+		ses->rx_start += used;
+		ses->pending_input -= used;
+		if (ses->dec.status == FRAME_MORE)
+			set_deadline(ses, stats_usec() + ses->gap_us);
+		else
+			packet_done(ses);
+		break;
+	  case ST_DRAIN:
+		ses->rx_start += ses->pending_input;
+		ses->pending_input = 0;
+		set_deadline(ses, stats_usec() + ses->drain_us);
+		break;
+	}
+}
+
+/* The deadline of the exchange has passed */
+static void expire (struct fuji_session *ses)
+{
+	switch (ses->state) {
+	  case ST_ACK:
+		timed_out(ses);
+		ack_failed(ses, -1);
+		break;
+	  case ST_PACKET:
+		if (ses->ex.waiting) {
+			timed_out(ses);
+			packet_failed(ses);
+			break;
+		}
+		/* In the middle of a frame */
+		if (ses->capture)
+			capture_record_int(ses->capture, CAPTURE_TIMEOUT,
+					   (ses->gap_us + 999) / 1000);
+		ses->stats.frame_errors[STATS_ERR_TIMEOUT]++;
+		start_drain(ses, ST_PACKET);
+		break;
+	  case ST_DRAIN:
+		drain_done(ses);
+		break;
+	}
+}
+
+/* Read what has come, and advance the exchange */
+static void process_input (struct fuji_session *ses)
+{
+	int ret;
+
+	while (ses->state != ST_IDLE) {
+		ret = fill_input(ses);
+		if (ret == 0)
+			return;
+		if (ret < 0) {
+			complete(ses, fail(ses, FUJI_ERR_IO, "Cannot read the device: %s",
+					   strerror(errno)));
+			return;
+		}
+		step(ses);
+	}
+}
+
+/* Run the exchange to completion, and return its result */
+static int run_exchange (struct fuji_session *ses)
+{
+	long long left;
+	int ret;
+
+	while (ses->state != ST_IDLE) {
+		left = ses->deadline - stats_usec();
+		ret = wait_for_input(ses, left);
+		if (ret > 0)
+			process_input(ses);
+		else if (ret < 0)
+			complete(ses, fail(ses, FUJI_ERR_IO, "Cannot read the device: %s",
+					   strerror(errno)));
+		else if (stats_usec() >= ses->deadline)
+			expire(ses);
+	}
+	return ses->result;
+}
+
+/*
+ * Set up a command, preceded by the query of its duration (0x51) the
+ * first time, and send it.
+ */
+static int start_command (struct fuji_session *ses, int len, const unsigned char *data,
+			  struct fuji_sink *sink)
+{
+	struct fuji_exchange *ex = &ses->ex;
+	int op = data[1];
+
+	if (ses->state != ST_IDLE)
+		return fail(ses, FUJI_ERR_BUSY, "Cannot issue command %02x while busy", op);
+	if (len > FUJI_PACKET_MAX)
+		len = FUJI_PACKET_MAX;
+	memset(ex, 0, sizeof(*ex));
+	ex->kind = EX_COMMAND;
+	ex->op = op;
+	ex->len = len;
+	ex->frame = ses->frame;
+	ex->flen = frame_encode(ses->frame, data, len, 1);
+	ex->sink = sink;
+	ses->prelude = 0;
+	if (op != 0x51 && ses->has_cmd[0x51] && ses->profile.info[op] < 0) {
+		unsigned char b[5] = { 0, 0x51, 1, 0, op };
+
+		ses->next = *ex;
+		ses->prelude = 1;
+		ex->op = 0x51;
+		ex->len = 5;
+		ex->frame = ses->qframe;
+		ex->flen = frame_encode(ses->qframe, b, 5, 1);
+		ex->sink = NULL;
+	}
+	begin(ses);
+	return 0;
+}
+
+/*
+ * Send a command and receive its answer. Each packet of the answer is
+ * handed to "sink" once acknowledged, if there's one; the last packet
+ * is left in ses->answer anyway. Returns the number of bytes received.
+ */
+int fuji_cmd (struct fuji_session *ses, int len, const unsigned char *data,
+	      struct fuji_sink *sink)
+{
+	int ret;
+
+	if ((ret = start_command(ses, len, data, sink)) < 0)
+		return ret;
+	return run_exchange(ses);
+}
+
+/* Send an encoded data frame; its ACK is waited for by run_exchange() */
+static int start_frame (struct fuji_session *ses, int op, int len,
+			const unsigned char *frame, int flen)
+{
+	struct fuji_exchange *ex = &ses->ex;
+
+	if (ses->state != ST_IDLE)
+		return fail(ses, FUJI_ERR_BUSY, "Cannot send data while busy");
+	memset(ex, 0, sizeof(*ex));
+	ex->kind = EX_FRAME;
+	ex->op = op;
+	ex->len = len;
+	ex->frame = frame;
+	ex->flen = flen;
+	ses->prelude = 0;
+	begin(ses);
+	return 0;
+}
+
+/*
+ * The engine: the exchanges of all its sessions progress together, in
+ * fuji_engine_run(), which waits for their input and timers with epoll.
+ */
+struct fuji_engine *fuji_engine_new (void)
+{
+	struct fuji_engine *eng;
+
+	if ((eng = calloc(1, sizeof(struct fuji_engine))) == NULL)
+		return NULL;
+	if ((eng->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		free(eng);
+		return NULL;
+	}
+	return eng;
+}
+
+void fuji_engine_free (struct fuji_engine *eng)
+{
+	if (eng == NULL)
+		return;
+	close(eng->epfd);
+	free(eng);
+}
+
+int fuji_engine_add (struct fuji_engine *eng, struct fuji_session *ses)
+{
+	struct epoll_event ev;
+	int i;
+
+	if (ses->engine != NULL || ses->fd < 0)
+		return fail(ses, FUJI_ERR_BUSY, "The session cannot be added to an engine");
+	ses->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (ses->timerfd < 0)
+		return fail(ses, FUJI_ERR_IO, "timerfd_create: %s", strerror(errno));
+	for (i = 0; i < 2; i++) {
+		ses->watch[i].ses = ses;
+		ses->watch[i].timer = i;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &ses->watch[i];
+		if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, i ? ses->timerfd : ses->fd, &ev) < 0) {
+			i = fail(ses, FUJI_ERR_IO, "epoll_ctl: %s", strerror(errno));
+			epoll_ctl(eng->epfd, EPOLL_CTL_DEL, ses->fd, &ev);
+			close(ses->timerfd);
+			ses->timerfd = -1;
+			return i;
+		}
+	}
+	ses->engine = eng;
+	return 0;
+}
+
+void fuji_engine_remove (struct fuji_session *ses)
+{
+	struct fuji_engine *eng = ses->engine;
+	struct epoll_event ev;
+
+	if (eng == NULL)
+		return;
+	if (ses->async) {
+		/* Abandoned */
+		ses->async = 0;
+		ses->done = NULL;
+		ses->state = ST_IDLE;
+		eng->busy--;
+	}
+	epoll_ctl(eng->epfd, EPOLL_CTL_DEL, ses->fd, &ev);
+	epoll_ctl(eng->epfd, EPOLL_CTL_DEL, ses->timerfd, &ev);
+	close(ses->timerfd);
+	ses->timerfd = -1;
+	ses->engine = NULL;
+}
+
+/*
+ * Start a command on a session of an engine. "done" is called from
+ * fuji_engine_run() with what fuji_cmd() would have returned; it may
+ * submit the next command. The command is copied, but "sink" must stay
+ * valid until then.
+ */
+int fuji_submit (struct fuji_session *ses, int len, const unsigned char *data,
+		 struct fuji_sink *sink,
+		 void (*done) (struct fuji_session *ses, int result, void *arg), void *arg)
+{
+	int ret;
+
+	if (ses->engine == NULL)
+		return fail(ses, FUJI_ERR_BUSY, "The session is not in an engine");
+	if ((ret = start_command(ses, len, data, sink)) < 0)
+		return ret;
+	ses->async = 1;
+	ses->done = done;
+	ses->done_arg = arg;
+	ses->engine->busy++;
+	return 0;
+}
+
+/*
+ * Wait up to "timeout" ms (-1 for ever) for something to happen on the
+ * sessions, and advance their exchanges. Returns the number of commands
+ * still in progress, or -1 on error.
+ */
+int fuji_engine_run (struct fuji_engine *eng, int timeout)
+{
+	struct epoll_event ev[64];
+	struct fuji_session *ses;
+	struct fuji_watch *w;
+	unsigned long long n;
+	int i, nev;
+
+	nev = epoll_wait(eng->epfd, ev, 64, timeout);
+	if (nev < 0)
+		return (errno == EINTR) ? eng->busy : -1;
+	for (i = 0; i < nev; i++) {
+		w = ev[i].data.ptr;
+		ses = w->ses;
+		if (w->timer) {
+			if (read(ses->timerfd, &n, sizeof(n)) < 0)
+				continue;
+			if (ses->state != ST_IDLE && stats_usec() >= ses->deadline)
+				expire(ses);
+			continue;
+		}
+		if (ses->state != ST_IDLE)
+			process_input(ses);
+		else if (fill_input(ses) > 0)
+			ses->pending_input = 0;	/* nobody asked for it */
+		if (!(ev[i].events & (EPOLLHUP|EPOLLERR)) || ses->engine != eng)
+			continue;
+		/* Hung up: nothing more will come */
+		if (ses->state != ST_IDLE)
+			complete(ses, fail(ses, FUJI_ERR_IO, "Cannot read the device: %s",
+					   strerror(EIO)));
+		if (ses->engine == eng)
+			epoll_ctl(eng->epfd, EPOLL_CTL_DEL, ses->fd, &ev[i]);
+	}
+	return eng->busy;
+}
+
+static int cmd0 (struct fuji_session *ses, int c0, int c1)
+{
+	unsigned char b[4];
+
+	b[0] = c0; b[1] = c1;
+	b[2] = b[3] = 0;
+	return fuji_cmd(ses, 4, b, NULL);
+}
+
+static int cmd1 (struct fuji_session *ses, int c0, int c1, int arg)
+{
+	unsigned char b[5];
+
+	b[0] = c0; b[1] = c1;
+	b[2] =  1; b[3] =  0;
+	b[4] = arg;
+	return fuji_cmd(ses, 5, b, NULL);
+}
+
+static int cmd2 (struct fuji_session *ses, int c0, int c1, int arg, struct fuji_sink *sink)
+{
+	unsigned char b[6];
+
+	b[0] = c0; b[1] = c1;
+	b[2] =  2; b[3] =  0;
+	b[4] = arg; b[5] = arg>>8;
+	return fuji_cmd(ses, 6, b, sink);
+}
+
+/* Little-endian integer of the answer, at "pos" */
+static int answer_int (struct fuji_session *ses, int pos, int len)
+{
+	unsigned char *p = ses->answer + pos;
+
+	return len == 2 ? p[0] + (p[1]<<8)
+		: p[0] + (p[1]<<8) + (p[2]<<16) + (p[3]<<24);
+}
+
+char *dc_version_info (struct fuji_session *ses)
+{
+	return cmd0(ses, 0, 0x09) < 0 ? NULL : (char *) ses->answer+4;
+}
+
+char *dc_camera_type (struct fuji_session *ses)
+{
+	return cmd0(ses, 0, 0x29) < 0 ? NULL : (char *) ses->answer+4;
+}
+
+char *dc_camera_id (struct fuji_session *ses)
+{
+	return cmd0(ses, 0, 0x80) < 0 ? NULL : (char *) ses->answer+4;
+}
+
+/* Camera ID without trailing blanks, for use as a cache key */
+char *fuji_camera_key (struct fuji_session *ses)
+{
+	char *id;
+	int i;
+
+	if (!ses->key[0]) {
+		if ((id = dc_camera_id(ses)) == NULL)
+			return NULL;
+		sprintf(ses->key, "%.10s", id);
+		for (i = strlen(ses->key); i > 0 && ses->key[i-1] == ' '; i--)
+			ses->key[i-1] = '\0';
+		if (!ses->key[0])
+			strcpy(ses->key, "noid");
+	}
+	return ses->key;
+}
+
+int dc_set_camera_id (struct fuji_session *ses, const char *id)
+{
+	unsigned char b[14];
+	int n = strlen(id);
+
+	if (n > 10)
+		n = 10;
+	b[0] = 0;
+	b[1] = 0x82;
+	b[2] = n;
+	b[3] = 0;
+	memcpy(b+4, id, n);
+	ses->key[0] = '\0';
+	return fuji_cmd(ses, n+4, b, NULL);
+}
+
+char *dc_get_date (struct fuji_session *ses)
+{
+	char *fmtdate = ses->date;
+	unsigned char *answer = ses->answer;
+
+	if (cmd0(ses, 0, 0x84) < 0)
+		return NULL;
+	strcpy(fmtdate, "YYYY/MM/DD HH:MM:SS");
+	memcpy(fmtdate,    answer+4,   4);	/* year */
+	memcpy(fmtdate+5,  answer+8,   2);	/* month */
+	memcpy(fmtdate+8,  answer+10,  2);	/* day */
+	memcpy(fmtdate+11, answer+12,  2);	/* hour */
+	memcpy(fmtdate+14, answer+14,  2);	/* minutes */
+	memcpy(fmtdate+17, answer+16,  2);	/* seconds */
+
+	return fmtdate;
+}
+
+int dc_set_date (struct fuji_session *ses, const char *date)
+{
+	unsigned char b[18];
+	int n = strlen(date);
+
+	if (n > 14)
+		n = 14;
+	b[0] = 0;
+	b[1] = 0x86;
+	b[2] = n;
+	b[3] = 0;
+	memcpy(b+4, date, n);
+	return fuji_cmd(ses, n+4, b, NULL);
+}
+
+int dc_get_flash_mode (struct fuji_session *ses)
+{
+	int ret = cmd0(ses, 0, 0x30);
+
+	return ret < 0 ? ret : ses->answer[4];
+}
+
+int dc_set_flash_mode (struct fuji_session *ses, int mode)
+{
+	int ret = cmd1(ses, 0, 0x32, mode);
+
+	return ret < 0 ? ret : ses->answer[4];
+}
+
+int dc_nb_pictures (struct fuji_session *ses)
+{
+	int ret = cmd0(ses, 0, 0x0b);
+
+	return ret < 0 ? ret : answer_int(ses, 4, 2);
+}
+
+char *dc_picture_name (struct fuji_session *ses, int i)
+{
+	return cmd2(ses, 0, 0x0a, i, NULL) < 0 ? NULL : (char *) ses->answer+4;
+}
+
+int dc_picture_size (struct fuji_session *ses, int i)
+{
+	int ret = cmd2(ses, 0, 0x17, i, NULL);
+
+	return ret < 0 ? ret : answer_int(ses, 4, 4);
+}
+
+char *dc_latest_picture (struct fuji_session *ses)
+{
+	return cmd0(ses, 0, 0x15) < 0 ? NULL : (char *) ses->answer+4;
+}
+
+int dc_free_memory (struct fuji_session *ses)
+{
+	int ret = cmd0(ses, 0, 0x1B);
+
+	return ret < 0 ? ret : answer_int(ses, 5, 4);
+}
+
+int dc_charge_flash (struct fuji_session *ses, int amount)
+{
+	int ret = cmd2(ses, 0, 0x34, amount, NULL);
+
+	return ret < 0 ? ret : ses->answer[4];
+}
+
+int dc_take_picture (struct fuji_session *ses)
+{
+	int ret = cmd0(ses, 0, 0x27);
+
+	return ret < 0 ? ret : answer_int(ses, 4, 4);
+}
+
+/* Returns 0 if the frame was deleted, the camera's status otherwise */
+int dc_delete_frame (struct fuji_session *ses, int i)
+{
+	int ret = cmd2(ses, 0, 0x19, i, NULL);
+
+	return ret < 0 ? ret : ses->answer[4];
+}
+
+int dc_get_picture (struct fuji_session *ses, int i, struct fuji_sink *sink)
+{
+	return cmd2(ses, 0, 0x02, i, sink);
+}
+
+/* The beginning of the picture, with the Exif header and thumbnail */
+int dc_get_exif (struct fuji_session *ses, int i, struct fuji_sink *sink)
+{
+	return cmd2(ses, 0, 0x00, i, sink);
+}
+
+int dc_take_preview (struct fuji_session *ses)
+{
+	return cmd0(ses, 0, 0x64);
+}
+
+int dc_get_preview (struct fuji_session *ses, struct fuji_sink *sink)
+{
+	unsigned char b[4] = { 0, 0x62, 0, 0 };
+
+	return fuji_cmd(ses, 4, b, sink);
+}
+
+/*
+ * The data frames of an upload aren't answered, only acknowledged. Each
+ * frame is encoded while the previous one is still on the wire.
+ */
+int dc_upload (struct fuji_session *ses, const char *name,
+	       const unsigned char *data, long size)
+{
+	unsigned char frames[2][FRAME_MAX_ENCODED(4+UPLOAD_CHUNK)];
+	unsigned char buffer[4+UPLOAD_CHUNK];
+	int flen[2], cur, len, last, c;
+	long pos;
+
+	buffer[0] = 0;
+	buffer[1] = 0x0F;
+	buffer[2] = 12;
+	buffer[3] = 0;
+	memset(buffer+4, 0, 12);
+	strncpy((char *) buffer+4, name, 12);
+	if ((c = fuji_cmd(ses, 16, buffer, NULL)) < 0)
+		return c;
+	if (ses->answer[4] != 0)
+		return fail(ses, FUJI_ERR_REFUSED, "rejected by the camera");
+
+	buffer[1] = 0x0E;
+	cur = 0;
+	pos = 0;
+	flen[0] = 0;
+	while (pos < size) {
+		len = (size - pos < UPLOAD_CHUNK) ? size - pos : UPLOAD_CHUNK;
+		last = (pos + len == size);
+		if (flen[cur] == 0) {
+			/* Only the first one is not encoded in advance */
+			buffer[2] = len;
+			buffer[3] = len >> 8;
+			memcpy(buffer+4, data + pos, len);
+			flen[cur] = frame_encode(frames[cur], buffer, 4+len, last);
+		}
+		if (!last && ses->interrupted && *ses->interrupted)
+			return fail(ses, FUJI_ERR_INTR, "Interrupted!");
+		if ((c = start_frame(ses, 0x0E, 4+len, frames[cur], flen[cur])) < 0)
+			return c;
+		/* Encode the next frame while this one is on its way */
+		flen[!cur] = 0;
+		if (!last) {
+			c = (size - pos - len < UPLOAD_CHUNK) ?
+				size - pos - len : UPLOAD_CHUNK;
+			buffer[2] = c;
+			buffer[3] = c >> 8;
+			memcpy(buffer+4, data + pos + len, c);
+			flen[!cur] = frame_encode(frames[!cur], buffer, 4+c,
+						  pos + len + c == size);
+		}
+		if ((c = run_exchange(ses)) < 0) {
+			if (c == FUJI_ERR_SEND)
+				fail(ses, c, "Cannot upload %.12s, aborting.", name);
+			return c;
+		}
+		pos += len;
+		cur = !cur;
+	}
+	return 0;
+}
+
+/*
+ * Fill has_cmd[]. The command set of the profile is used if the camera
+ * has the same ID; otherwise it is queried, and the profile is updated.
+ */
+int fuji_get_commands (struct fuji_session *ses, int ds7, int requery)
+{
+	struct fuji_profile *pr = &ses->profile;
+	char *key;
+	int i, ret;
+
+	memset(ses->has_cmd, 0, 256);
+	if (ds7) {
+		/*
+		 * The DS-7 doesn't have the 4C command to query capabilities;
+		 * therefore, we assume a very minimal command set.
+		 */
+#if 0
+		/*
+		 * If you are daring, uncomment these lines; what follows
+		 * is what I conjecture to be the actual capability set.
+		 * Read mx700-commands.html for details. I'd like to have
+		 * your feedback about this.
+		 */
+		static const unsigned char ds7_cmds[] = {
+			0x00, 0x02, 0x07, 0x09, 0x0a, 0x0b, 0x0c, 0x0e,
+			0x0f, 0x11, 0x13, 0x15, 0x17, 0x19, 0x1b, 0x27,
+			0x29, 0x30, 0x32, 0x34 };
+		for (i = 0; i < sizeof(ds7_cmds); i++)
+			ses->has_cmd[ds7_cmds[i]] = 1;
+#endif
+		return 0;
+	}
+	if (pr->id[0] && pr->cmds[0x80] && !requery) {
+		ses->has_cmd[0x80] = 1;
+		if ((key = fuji_camera_key(ses)) == NULL)
+			return FUJI_ERR_RECV;
+		if (!strcmp(key, pr->id)) {
+			memcpy(ses->has_cmd, pr->cmds, 256);
+			return 0;
+		}
+	}
+	if ((ret = cmd0(ses, 0, 0x4c)) < 0)
+		return ret;
+	for (i = 4; i < ses->answer_len; i++)
+		ses->has_cmd[ses->answer[i]] = 1;
+	if (ses->has_cmd[0x80]) {
+		if ((key = fuji_camera_key(ses)) == NULL)
+			return FUJI_ERR_RECV;
+		if (strcmp(pr->id, key))
+			memset(pr->info, 0xff, sizeof(pr->info));
+		strcpy(pr->id, key);
+		memcpy(pr->cmds, ses->has_cmd, 256);
+		pr->changed = 1;
+	}
+	return 0;
+}
+
+static void close_connection (struct fuji_session *ses)
+{
+	put_byte(ses, EOT);
+	tcdrain(ses->fd);
+	/* Give the camera time to switch speeds; in low-latency mode,
+	   ping_camera() waits until it has instead */
+	if (!ses->low_latency)
+		usleep(50000);
+}
+
+/*
+ * Ask the driver to pass the input on at once, rather than when its
+ * FIFO or latency timer says so. Not all of them can; ses->ll_driver
+ * tells whether the input comes at once. Devices which aren't serial
+ * ports (pseudo-terminals) have nothing to hold it.
+ */
+static void driver_low_latency (struct fuji_session *ses, int on)
+{
+#if defined(TIOCGSERIAL) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ss;
+
+	if (!on) {
+		if (ses->serial_flags >= 0
+		    && ioctl(ses->fd, TIOCGSERIAL, &ss) == 0) {
+			ss.flags = ses->serial_flags;
+			ioctl(ses->fd, TIOCSSERIAL, &ss);
+		}
+		return;
+	}
+	ses->serial_flags = -1;
+	if (ioctl(ses->fd, TIOCGSERIAL, &ss) < 0) {
+		ses->ll_driver = 1;
+		return;
+	}
+	ses->serial_flags = ss.flags;
+	ss.flags |= ASYNC_LOW_LATENCY;
+	ses->ll_driver = (ioctl(ses->fd, TIOCSSERIAL, &ss) == 0);
+#endif
+}
+
+void fuji_close (struct fuji_session *ses)
+{
+	if (ses->fd < 0)
+		return;
+	fuji_engine_remove(ses);
+	ses->state = ST_IDLE;
+	close_connection(ses);
+	if (ses->low_latency)
+		driver_low_latency(ses, 0);
+	tcsetattr(ses->fd, TCSANOW, &ses->oldt);
+	close(ses->fd);
+	ses->fd = -1;
+	ses->pending_input = 0;
+}
+
+int fuji_open (struct fuji_session *ses, const char *device)
+{
+	struct termios *newt = &ses->newt;
+	int ret;
+
+	/* Non-blocking: the exchanges wait with poll() or epoll */
+	ses->fd = open(device, O_RDWR|O_NOCTTY|O_NONBLOCK);
+	if (ses->fd < 0)
+		return fail(ses, FUJI_ERR_IO, "Cannot open device %s: %s",
+			    device, strerror(errno));
+	if (tcgetattr(ses->fd, &ses->oldt) < 0) {
+		ret = fail(ses, FUJI_ERR_IO, "tcgetattr: %s", strerror(errno));
+		close(ses->fd);
+		ses->fd = -1;
+		return ret;
+	}
+	*newt = ses->oldt;
+	newt->c_iflag |= (PARMRK|INPCK);
+	newt->c_iflag &= ~(BRKINT|IGNBRK|IGNPAR|ISTRIP|INLCR|IGNCR|ICRNL|IXON|IXOFF);
+	newt->c_oflag &= ~(OPOST);
+	newt->c_cflag |= (CLOCAL|CREAD|CS8|PARENB);
+	newt->c_cflag &= ~(CSTOPB|HUPCL|PARODD);
+	newt->c_lflag &= ~(ECHO|ECHOE|ECHOK|ECHONL|ICANON|ISIG|NOFLSH|TOSTOP);
+	newt->c_cc[VMIN] = 0;
+	newt->c_cc[VTIME] = 0;
+	cfsetispeed(newt, B9600);
+	cfsetospeed(newt, B9600);
+	if (tcsetattr(ses->fd, TCSANOW, newt) < 0) {
+		ret = fail(ses, FUJI_ERR_IO, "tcsetattr: %s", strerror(errno));
+		close(ses->fd);
+		ses->fd = -1;
+		return ret;
+	}
+	ses->line_speed = 9600;
+	ses->ll_driver = 0;
+	if (ses->low_latency)
+		driver_low_latency(ses, 1);
+	set_gaps(ses);
+	if (ses->capture)
+		capture_record_int(ses->capture, CAPTURE_SPEED, 9600);
+	return attention(ses);
+}
+
+static void set_line_speed (struct fuji_session *ses, int posix_speed, int speed)
+{
+	cfsetispeed(&ses->newt, posix_speed);
+	cfsetospeed(&ses->newt, posix_speed);
+	tcsetattr(ses->fd, TCSANOW, &ses->newt);
+	ses->line_speed = speed;
+	set_gaps(ses);
+	if (ses->capture)
+		capture_record_int(ses->capture, CAPTURE_SPEED, speed);
+}
+
+/*
+ * Ask the camera to switch to the speed "bi". Returns 0 if it did, or
+ * 1 if it refused or doesn't answer at this speed; in the latter case
+ * the line is back at 9600 bps.
+ */
+static int try_baudrate (struct fuji_session *ses, const struct baudrate_info *bi)
+{
+	int ret;
+
+	if ((ret = cmd1(ses, 1, 7, bi->number)) < 0)
+		return ret;
+	if (ses->verbose)
+		say(ses, "set_baudrate: %6d bps %ssupported", bi->speed,
+		    ses->answer[4] ? "not " : "");
+	if (ses->answer[4])
+		return 1;
+	/* This speed should be supported. Let's see. */
+	close_connection(ses);
+	set_line_speed(ses, bi->posix_speed, bi->speed);
+	if (ping_camera(ses) == 0) {
+		if (ses->verbose)
+			say(ses, "set_baudrate: new speed is %d bps", bi->speed);
+		return 0;
+	}
+	say(ses, "set_baudrate: no answer at %d bps", bi->speed);
+	set_line_speed(ses, B9600, 9600);
+	if ((ret = attention(ses)) < 0)
+		return ret;
+	return 1;
+}
+
+/*
+ * Negotiate the fastest speed supported by the camera, trying first the
+ * one it was used at last time, which usually avoids probing the faster
+ * ones it doesn't support.
+ */
+int fuji_set_speed (struct fuji_session *ses, int speed)
+{
+	struct fuji_profile *pr = &ses->profile;
+	const struct baudrate_info *bi, *tried = NULL;
+	int ret;
+
+	if (pr->speed > 0 && speed < 0) {
+		for (bi = brinfo; bi->number; bi++)
+			if (bi->speed == pr->speed)
+				break;
+		if (bi->number) {
+			if ((ret = try_baudrate(ses, bi)) <= 0)
+				return ret < 0 ? ret : ses->line_speed;
+			tried = bi;
+		}
+	}
+	for (bi = brinfo; bi->number; bi++) {
+		/* Speed autodetection or not ? */
+		if (speed > 0 && speed != bi->speed)
+			continue;
+		if (bi == tried)
+			continue;
+		if ((ret = try_baudrate(ses, bi)) < 0)
+			return ret;
+		if (ret > 0)
+			continue;
+		if (bi->speed != pr->speed) {
+			pr->speed = bi->speed;
+			pr->changed = 1;
+		}
+		return ses->line_speed;
+	}
+	say(ses, "set_baudrate: still at 9600 bps");
+	return ses->line_speed;
+}
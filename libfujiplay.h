@@ -0,0 +1,217 @@
+/*
+ * libfujiplay: the serial protocol of the Fujifilm digital cameras (DS-7,
+ * MX-700 and their clones), as a library.
+ *
+ * Everything about a connection is kept in its session, so that several
+ * cameras can be driven from one process: sessions are independent and
+ * may be used from different threads, but a session must only be used
+ * by one thread at a time. An engine also lets a single thread drive
+ * many sessions at once, their commands progressing together. Nothing
+ * is fatal: the functions returning an int give a negative FUJI_ERR_*
+ * code on failure, those returning a string give NULL, and a message
+ * is left in ses->error. After an error during an exchange, the camera
+ * may still be sending; the session should then be closed.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef LIBFUJIPLAY_H
+#define LIBFUJIPLAY_H
+
+#include <termios.h>
+#include "frame.h"
+#include "stats.h"
+#include "capture.h"
+
+#define FUJI_PACKET_MAX	5000
+#define FUJI_RX_BUFSIZE	4096
+
+/* Error codes */
+#define FUJI_ERR_IO		-1	/* the device cannot be opened or set up */
+#define FUJI_ERR_NORESP		-2	/* the camera does not respond */
+#define FUJI_ERR_SEND		-3	/* command not acknowledged */
+#define FUJI_ERR_RECV		-4	/* answer not received */
+#define FUJI_ERR_INTR		-5	/* *ses->interrupted was set */
+#define FUJI_ERR_SINK		-6	/* the sink failed */
+#define FUJI_ERR_REFUSED	-7	/* the camera refused an upload */
+#define FUJI_ERR_BUSY		-8	/* a command is already in progress */
+
+/*
+ * Where the data of the transfers goes: write() is called for each
+ * packet, once acknowledged, with its offset in the whole answer. It
+ * returns a negative value to abort the transfer.
+ */
+struct fuji_sink {
+	int (*write) (void *arg, long offset, const unsigned char *data, int len);
+	void *arg;
+};
+
+/*
+ * What can be remembered about the camera on a device, from one session
+ * to the next: the speed it was last used at, its ID, its command set and
+ * the duration of each command as reported by 0x51 (in 1/10 s, -1 if
+ * unknown). "changed" is set when the session learns something new.
+ */
+struct fuji_profile {
+	int speed;
+	char id[16];
+	char cmds[256];
+	short info[256];
+	int changed;
+};
+
+/* Response time estimator of a command, in seconds */
+struct fuji_rtt {
+	double srtt, rttvar;
+	int samples;
+};
+
+/* The exchange in progress on a session: a command, or an upload frame */
+struct fuji_exchange {
+	int kind;
+	int op, len;
+	const unsigned char *frame;	/* encoded */
+	int flen;
+	struct fuji_sink *sink;
+	int retry, phase;
+	long offset;		/* of the next answer packet */
+	long long t0;
+	int waiting;		/* for the reply, since wait_start */
+	int wait_phase, wait_ms;
+	long long wait_start;
+};
+
+struct fuji_engine;
+
+/* What an epoll event of the engine is about */
+struct fuji_watch {
+	struct fuji_session *ses;
+	int timer;
+};
+
+struct fuji_session {
+	/* Set by the caller, after fuji_new() */
+	void *user;
+	int verbose;		/* log the speed negotiation */
+	int low_latency;	/* timeouts from the line speed, no sleeps */
+	volatile int *interrupted;	/* long transfers stop when set */
+	struct capture *capture;	/* records the traffic */
+	void (*log) (struct fuji_session *ses, const char *msg);
+	struct fuji_profile profile;	/* updated by the session */
+
+	/* Read by the caller (writer_us is left to it) */
+	char has_cmd[256];
+	int line_speed;
+	unsigned char answer[FUJI_PACKET_MAX];	/* the last packet */
+	int answer_len;
+	struct link_stats stats;
+	char error[128];
+
+	/* Private */
+	int fd;
+	struct termios oldt, newt;
+	int pending_input;
+	unsigned char *rx_start;
+	unsigned char rx_buffer[FUJI_RX_BUFSIZE];
+	unsigned char frame[FRAME_MAX_ENCODED(FUJI_PACKET_MAX)];
+	struct fuji_rtt rtt[257][3];
+	char key[16];
+	char date[20];
+	int gap_us, drain_us;	/* silences ending a frame, a drain */
+	int ll_driver, serial_flags;
+	int state, result;
+	long long deadline;	/* of the current step, 0 if none */
+	struct frame_decoder dec;
+	struct fuji_exchange ex, next;
+	int prelude;		/* ex is the 0x51 query before "next" */
+	unsigned char qframe[FRAME_MAX_ENCODED(5)];
+	int drain_from;
+	struct fuji_engine *engine;
+	int timerfd;
+	struct fuji_watch watch[2];
+	int async;
+	void (*done) (struct fuji_session *ses, int result, void *arg);
+	void *done_arg;
+};
+
+/* Sessions. fuji_new() returns NULL if out of memory */
+struct fuji_session *fuji_new (void);
+void fuji_free (struct fuji_session *ses);
+
+/*
+ * Open the device and wake the camera up, at 9600 bps. The session must
+ * be closed afterwards, even if this fails.
+ */
+int fuji_open (struct fuji_session *ses, const char *device);
+void fuji_close (struct fuji_session *ses);
+
+/*
+ * Switch to the fastest speed supported by the camera, or to "speed"
+ * only (if positive). The speed of the profile is tried first. Returns
+ * the new line speed.
+ */
+int fuji_set_speed (struct fuji_session *ses, int speed);
+
+/*
+ * Fill ses->has_cmd[]: from the profile if it's the same camera (unless
+ * "requery"), else by asking it. The DS-7 can't be asked.
+ */
+int fuji_get_commands (struct fuji_session *ses, int ds7, int requery);
+
+/* Send a command, whose answer goes to "sink" (or into ses->answer only) */
+int fuji_cmd (struct fuji_session *ses, int len, const unsigned char *data,
+	      struct fuji_sink *sink);
+
+const char *fuji_strerror (int err);
+
+/*
+ * Engines. A session is added once open, and removed by fuji_close().
+ * fuji_submit() starts a command; fuji_engine_run() waits up to
+ * "timeout" ms (-1 for ever) for the input and timeouts of all the
+ * sessions, and calls "done" with the result of the commands which have
+ * completed, as fuji_cmd() would have returned it. "done" may submit
+ * the next command, or remove the session, but not free it. The sink
+ * must remain valid until then. fuji_engine_run() returns the number of
+ * commands still in progress, or -1 on error.
+ */
+struct fuji_engine *fuji_engine_new (void);
+void fuji_engine_free (struct fuji_engine *eng);
+int fuji_engine_add (struct fuji_engine *eng, struct fuji_session *ses);
+void fuji_engine_remove (struct fuji_session *ses);
+int fuji_submit (struct fuji_session *ses, int len, const unsigned char *data,
+		 struct fuji_sink *sink,
+		 void (*done) (struct fuji_session *ses, int result, void *arg), void *arg);
+int fuji_engine_run (struct fuji_engine *eng, int timeout);
+
+/*
+ * The camera commands. The strings point into the session, and are only
+ * valid until the next command. The transfers return the number of bytes
+ * received.
+ */
+char *dc_version_info (struct fuji_session *ses);
+char *dc_camera_type (struct fuji_session *ses);
+char *dc_camera_id (struct fuji_session *ses);
+char *fuji_camera_key (struct fuji_session *ses);
+int dc_set_camera_id (struct fuji_session *ses, const char *id);
+char *dc_get_date (struct fuji_session *ses);
+int dc_set_date (struct fuji_session *ses, const char *date);
+int dc_get_flash_mode (struct fuji_session *ses);
+int dc_set_flash_mode (struct fuji_session *ses, int mode);
+int dc_nb_pictures (struct fuji_session *ses);
+char *dc_picture_name (struct fuji_session *ses, int i);
+int dc_picture_size (struct fuji_session *ses, int i);
+char *dc_latest_picture (struct fuji_session *ses);
+int dc_free_memory (struct fuji_session *ses);
+int dc_charge_flash (struct fuji_session *ses, int amount);
+int dc_take_picture (struct fuji_session *ses);
+int dc_delete_frame (struct fuji_session *ses, int i);
+int dc_get_picture (struct fuji_session *ses, int i, struct fuji_sink *sink);
+int dc_get_exif (struct fuji_session *ses, int i, struct fuji_sink *sink);
+int dc_take_preview (struct fuji_session *ses);
+int dc_get_preview (struct fuji_session *ses, struct fuji_sink *sink);
+
+/* Store "size" bytes as picture "name" (12 characters, or empty) */
+int dc_upload (struct fuji_session *ses, const char *name,
+	       const unsigned char *data, long size);
+
+#endif
@@ -0,0 +1,356 @@
+/*
+ * Streaming preview decoder. See preview.h.
+ *
+ * Released in the public domain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "yycc.h"
+#include "preview.h"
+
+/* Groups converted at once */
+#define BLOCK_GROUPS	1024
+
+int preview_format (const char *name)
+{
+	static const char *names[] = { "raw", "ppm", "png", "y4m" };
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (!strcmp(name, names[i]))
+			return i;
+	return -1;
+}
+
+void preview_init (struct preview *pv, int format, int fd)
+{
+	memset(pv, 0, sizeof(*pv));
+	pv->format = format;
+	pv->fd = fd;
+}
+
+void preview_free (struct preview *pv)
+{
+	free(pv->chroma);
+	pv->chroma = NULL;
+}
+
+static int flush_out (struct preview *pv)
+{
+	unsigned char *p = pv->out;
+	int ret;
+
+	while (pv->olen > 0) {
+		ret = write(pv->fd, p, pv->olen);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		pv->olen -= ret;
+	}
+	return 0;
+}
+
+static unsigned long crc32_update (unsigned long crc, const unsigned char *p, long n)
+{
+	int k;
+
+	while (n-- > 0) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return crc;
+}
+
+/* Append to the output buffer; inside a PNG chunk, update its CRC */
+static int put (struct preview *pv, const void *data, long n)
+{
+	const unsigned char *p = data;
+	long k;
+
+	if (pv->in_chunk)
+		pv->crc = crc32_update(pv->crc, p, n);
+	while (n > 0) {
+		if (pv->olen == sizeof(pv->out) && flush_out(pv) < 0)
+			return -1;
+		k = sizeof(pv->out) - pv->olen;
+		if (k > n)
+			k = n;
+		memcpy(pv->out + pv->olen, p, k);
+		pv->olen += k;
+		p += k;
+		n -= k;
+	}
+	return 0;
+}
+
+static void put32 (unsigned char *p, unsigned long x)
+{
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+/*
+ * PNG chunks. Their length comes first, so that of IDAT is computed
+ * from the dimensions: the pixels are stored without compression.
+ */
+static int chunk_begin (struct preview *pv, const char *type, unsigned long len)
+{
+	unsigned char b[4];
+
+	put32(b, len);
+	if (put(pv, b, 4) < 0)
+		return -1;
+	pv->crc = 0xFFFFFFFF;
+	pv->in_chunk = 1;
+	return put(pv, type, 4);
+}
+
+static int chunk_end (struct preview *pv)
+{
+	unsigned char b[4];
+
+	pv->in_chunk = 0;
+	put32(b, pv->crc ^ 0xFFFFFFFF);
+	return put(pv, b, 4);
+}
+
+static void adler_update (struct preview *pv, const unsigned char *p, long n)
+{
+	unsigned long a = pv->adler1, b = pv->adler2;
+	long k;
+
+	while (n > 0) {
+		/* No overflow before 5552 bytes */
+		k = (n < 5552) ? n : 5552;
+		n -= k;
+		while (k-- > 0) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	pv->adler1 = a;
+	pv->adler2 = b;
+}
+
+/* Pixels of a PNG: in stored deflate blocks, each row after its filter byte */
+static int png_pixels (struct preview *pv, const unsigned char *p, long n)
+{
+	static const unsigned char filter = 0;
+	const unsigned char *src;
+	unsigned char hdr[5];
+	long k;
+
+	while (n > 0) {
+		if (pv->block_left == 0) {
+			k = (pv->raw_left < 65535) ? pv->raw_left : 65535;
+			hdr[0] = (k == pv->raw_left);
+			hdr[1] = k;
+			hdr[2] = k >> 8;
+			hdr[3] = ~k;
+			hdr[4] = ~k >> 8;
+			if (put(pv, hdr, 5) < 0)
+				return -1;
+			pv->block_left = k;
+		}
+		if (pv->row_left == 0) {
+			src = &filter;
+			k = 1;
+			pv->row_left = 3L * pv->width;
+		} else {
+			src = p;
+			k = n;
+			if (k > pv->row_left)
+				k = pv->row_left;
+			if (k > pv->block_left)
+				k = pv->block_left;
+			p += k;
+			n -= k;
+			pv->row_left -= k;
+		}
+		adler_update(pv, src, k);
+		if (put(pv, src, k) < 0)
+			return -1;
+		pv->block_left -= k;
+		pv->raw_left -= k;
+	}
+	return 0;
+}
+
+/* The header of a frame is complete: write that of the output */
+static int frame_begin (struct preview *pv)
+{
+	static const unsigned char png_sig[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	static const unsigned char zlib_hdr[2] = { 0x78, 0x01 };
+	unsigned char ihdr[13];
+	char buf[128];
+	long raw, blocks;
+	int n;
+
+	pv->width = pv->head[0] + 256 * pv->head[1];
+	pv->height = pv->head[2] + 256 * pv->head[3];
+	pv->groups = ((long) pv->width * pv->height + 1) / 2;
+	pv->pos = 0;
+	switch (pv->format) {
+	  case PREVIEW_PPM:
+		n = sprintf(buf, "P6\n%d %d\n255\n", pv->width, pv->height);
+		return put(pv, buf, n);
+	  case PREVIEW_Y4M:
+		if (pv->frames == 0) {
+			n = sprintf(buf, "YUV4MPEG2 W%d H%d F1:1 Ip A1:1 C422 "
+				"XCOLORRANGE=FULL\n", pv->width, pv->height);
+			if (put(pv, buf, n) < 0)
+				return -1;
+			pv->y4m_width = pv->width;
+			pv->y4m_height = pv->height;
+		}
+		/* All frames must have the same even width */
+		if (pv->width != pv->y4m_width || pv->height != pv->y4m_height
+		    || pv->width % 2) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (pv->chroma == NULL
+		    && (pv->chroma = malloc(2 * pv->groups + 1)) == NULL)
+			return -1;
+		return put(pv, "FRAME\n", 6);
+	  case PREVIEW_PNG:
+		if (pv->width == 0 || pv->height == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		raw = pv->height * (1 + 3L * pv->width);
+		blocks = (raw + 65534) / 65535;
+		put32(ihdr, pv->width);
+		put32(ihdr+4, pv->height);
+		ihdr[8] = 8;	/* bits per sample */
+		ihdr[9] = 2;	/* RGB */
+		ihdr[10] = ihdr[11] = ihdr[12] = 0;
+		if (put(pv, png_sig, 8) < 0
+		    || chunk_begin(pv, "IHDR", 13) < 0
+		    || put(pv, ihdr, 13) < 0
+		    || chunk_end(pv) < 0
+		    || chunk_begin(pv, "IDAT", 2 + raw + 5*blocks + 4) < 0)
+			return -1;
+		pv->raw_left = raw;
+		pv->block_left = pv->row_left = 0;
+		pv->adler1 = 1;
+		pv->adler2 = 0;
+		return put(pv, zlib_hdr, 2);
+	}
+	return 0;
+}
+
+/* Convert and write "n" complete groups */
+static int put_groups (struct preview *pv, const unsigned char *g, long n)
+{
+	unsigned char buf[6 * BLOCK_GROUPS];
+	long k, i, bytes;
+
+	if (n > pv->groups - pv->pos)
+		n = pv->groups - pv->pos;
+	while (n > 0) {
+		k = (n < BLOCK_GROUPS) ? n : BLOCK_GROUPS;
+		if (pv->format == PREVIEW_Y4M) {
+			/* Y plane now, Cb and Cr planes at the end */
+			for (i = 0; i < k; i++) {
+				buf[2*i] = g[4*i];
+				buf[2*i+1] = g[4*i+1];
+				pv->chroma[pv->pos+i] = g[4*i+2];
+				pv->chroma[pv->groups+pv->pos+i] = g[4*i+3];
+			}
+			if (put(pv, buf, 2*k) < 0)
+				return -1;
+		} else {
+			yycc_to_rgb(buf, g, k);
+			/* With an odd number of pixels, the last one is extra */
+			bytes = 6*k;
+			if (bytes > 3 * ((long) pv->width * pv->height - 2 * pv->pos))
+				bytes = 3 * ((long) pv->width * pv->height - 2 * pv->pos);
+			if (pv->format == PREVIEW_PNG) {
+				if (png_pixels(pv, buf, bytes) < 0)
+					return -1;
+			} else if (put(pv, buf, bytes) < 0)
+				return -1;
+		}
+		pv->pos += k;
+		g += 4*k;
+		n -= k;
+	}
+	return 0;
+}
+
+int preview_feed (struct preview *pv, const unsigned char *data, int len)
+{
+	int k;
+
+	if (pv->format == PREVIEW_RAW)
+		return put(pv, data, len);
+	while (pv->hlen < YYCC_HEADER && len > 0) {
+		pv->head[pv->hlen++] = *data++;
+		len--;
+		if (pv->hlen == YYCC_HEADER && frame_begin(pv) < 0)
+			return -1;
+	}
+	if (pv->npart && len > 0) {
+		k = 4 - pv->npart;
+		if (k > len)
+			k = len;
+		memcpy(pv->part + pv->npart, data, k);
+		pv->npart += k;
+		data += k;
+		len -= k;
+		if (pv->npart < 4)
+			return 0;
+		pv->npart = 0;
+		if (put_groups(pv, pv->part, 1) < 0)
+			return -1;
+	}
+	k = len / 4;
+	if (put_groups(pv, data, k) < 0)
+		return -1;
+	pv->npart = len - 4*k;
+	memcpy(pv->part, data + 4*k, pv->npart);
+	return 0;
+}
+
+int preview_end (struct preview *pv)
+{
+	static const unsigned char black[4] = { 0, 0, 128, 128 };
+	unsigned char b[4];
+
+	if (pv->format != PREVIEW_RAW) {
+		if (pv->hlen < YYCC_HEADER) {
+			errno = EIO;
+			return -1;
+		}
+		/* A truncated frame is completed in black */
+		while (pv->pos < pv->groups)
+			if (put_groups(pv, black, 1) < 0)
+				return -1;
+		if (pv->format == PREVIEW_Y4M
+		    && put(pv, pv->chroma, 2 * pv->groups) < 0)
+			return -1;
+		if (pv->format == PREVIEW_PNG) {
+			put32(b, (pv->adler2 << 16) | pv->adler1);
+			if (put(pv, b, 4) < 0 || chunk_end(pv) < 0
+			    || chunk_begin(pv, "IEND", 0) < 0 || chunk_end(pv) < 0)
+				return -1;
+		}
+	}
+	pv->hlen = pv->npart = 0;
+	pv->frames++;
+	return flush_out(pv);
+}
@@ -0,0 +1,54 @@
+/*
+ * Streaming decoder for the previews of the camera (see yycc.h). The
+ * data is fed as it arrives, in pieces of any size, and converted into
+ * PPM, PNG (uncompressed) or YUV4MPEG2 4:2:2 on the fly.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#define PREVIEW_RAW	0	/* as sent by the camera */
+#define PREVIEW_PPM	1
+#define PREVIEW_PNG	2
+#define PREVIEW_Y4M	3
+
+struct preview {
+	int format;
+	int fd;
+	int frames;		/* frames completed */
+	unsigned char head[4];	/* header of the current frame */
+	int hlen;
+	int width, height;
+	long groups, pos;	/* groups expected, and received */
+	unsigned char part[4];	/* incomplete group */
+	int npart;
+	unsigned char *chroma;	/* Y4M: Cb and Cr planes */
+	int y4m_width, y4m_height;
+	/* PNG */
+	unsigned long crc, adler1, adler2;
+	long raw_left, block_left, row_left;
+	int in_chunk;
+	/* Output buffer */
+	int olen;
+	unsigned char out[8192];
+};
+
+/* Format number for "raw", "ppm", "png" or "y4m"; -1 if unknown */
+int preview_format (const char *name);
+
+/* Start a stream of frames in the given format, written to "fd" */
+void preview_init (struct preview *pv, int format, int fd);
+
+/*
+ * Feed the next "len" bytes of the current frame. preview_end() then
+ * completes it (missing pixels are black). Both return -1 on write
+ * errors, with errno set.
+ */
+int preview_feed (struct preview *pv, const unsigned char *data, int len);
+int preview_end (struct preview *pv);
+
+void preview_free (struct preview *pv);
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * SHA-256 (FIPS 180-4), for the manifest of the downloaded pictures.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+
+#define SHA256_SIZE	32
+
+struct sha256 {
+	uint32_t h[8];
+	uint64_t len;		/* bytes hashed so far */
+	unsigned char buf[64];
+	int n;			/* bytes in buf */
+};
+
+void sha256_init (struct sha256 *s);
+void sha256_update (struct sha256 *s, const void *data, long len);
+void sha256_final (struct sha256 *s, unsigned char digest[SHA256_SIZE]);
+
+/* The digest of "len" bytes, in hex (65 bytes with the final '\0') */
+void sha256_hex (const void *data, long len, char *hex);
+
+/* The same for what's left to read from "fd". Returns its size, or -1 */
+long sha256_fd_hex (int fd, char *hex);
+
+#endif
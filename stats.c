@@ -0,0 +1,90 @@
+/*
+ * Transfer statistics. See stats.h.
+ *
+ * Released in the public domain.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+long long stats_usec (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void stats_init (struct link_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->start_us = stats_usec();
+}
+
+void stats_command (struct link_stats *st, int op, long long us)
+{
+	struct op_stats *o = &st->ops[op & 0xFF];
+	int i;
+
+	if (o->calls == 0 || us < o->min_us)
+		o->min_us = us;
+	if (us > o->max_us)
+		o->max_us = us;
+	o->calls++;
+	o->total_us += us;
+	for (i = 0; i < STATS_BUCKETS-1 && us >= (2LL << i); i++)
+		continue;
+	o->hist[i]++;
+}
+
+void stats_json (FILE *fd, const char *device, const struct link_stats *st)
+{
+	static const char *errors[STATS_ERRORS] = {
+		"timeout", "syntax", "parity", "overflow", "checksum", "length" };
+	const struct op_stats *o;
+	int op, i, first = 1;
+
+	fprintf(fd, "{\"device\": \"");
+	for (; *device; device++)
+		if (*device == '"' || *device == '\\')
+			fprintf(fd, "\\%c", *device);
+		else if ((unsigned char) *device >= ' ')
+			putc(*device, fd);
+	fprintf(fd, "\",\n  \"elapsed_us\": %lld,\n", stats_usec() - st->start_us);
+	fprintf(fd, "  \"frames_out\": %ld, \"frames_in\": %ld,\n",
+		st->frames_out, st->frames_in);
+	fprintf(fd, "  \"bytes_out\": %ld, \"bytes_in\": %ld,\n",
+		st->bytes_out, st->bytes_in);
+	fprintf(fd, "  \"naks_out\": %ld, \"naks_in\": %ld, \"timeouts\": %ld,\n",
+		st->naks_out, st->naks_in, st->timeouts);
+	fprintf(fd, "  \"parity_errors\": %ld,\n  \"frame_errors\": {", st->parity_errors);
+	for (i = 0; i < STATS_ERRORS; i++)
+		fprintf(fd, "%s\"%s\": %ld", i ? ", " : "", errors[i], st->frame_errors[i]);
+	fprintf(fd, "},\n  \"idle_us\": %lld, \"writer_us\": %lld,\n",
+		st->idle_us, st->writer_us);
+	fprintf(fd, "  \"commands\": {");
+	for (op = 0; op < 256; op++) {
+		o = &st->ops[op];
+		if (o->calls == 0)
+			continue;
+		fprintf(fd, "%s\n    \"%02x\": {\"calls\": %ld, \"retries\": %ld, "
+			"\"bytes_out\": %ld, \"bytes_in\": %ld,\n",
+			first ? "" : ",", op, o->calls, o->retries,
+			o->bytes_out, o->bytes_in);
+		fprintf(fd, "      \"total_us\": %lld, \"min_us\": %lld, \"max_us\": %lld,\n",
+			o->total_us, o->min_us, o->max_us);
+		fprintf(fd, "      \"ack_us\": %lld, \"answer_us\": %lld, \"next_us\": %lld,\n",
+			o->wait_us[0], o->wait_us[1], o->wait_us[2]);
+		fprintf(fd, "      \"histogram_us\": {");
+		for (i = 0, first = 1; i < STATS_BUCKETS; i++) {
+			if (o->hist[i] == 0)
+				continue;
+			fprintf(fd, "%s\"%lld\": %ld", first ? "" : ", ",
+				i ? 1LL << i : 0, o->hist[i]);
+			first = 0;
+		}
+		fprintf(fd, "}}");
+	}
+	fprintf(fd, "\n  }}");
+}
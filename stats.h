@@ -0,0 +1,55 @@
+/*
+ * Transfer statistics of a serial link: latency histograms of each
+ * command, traffic in each direction, errors and retries, and where the
+ * time went (waiting for the camera, or for the disk).
+ *
+ * Released in the public domain.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/* Bucket i counts the durations in [2^i, 2^(i+1)) microseconds */
+#define STATS_BUCKETS	32
+
+/* Why a received frame was thrown away (see frame.h for 1 to 4) */
+#define STATS_ERR_TIMEOUT	0	/* incomplete frame */
+#define STATS_ERR_LENGTH	5	/* length field doesn't match */
+#define STATS_ERRORS		6
+
+struct op_stats {
+	long calls;
+	long retries;		/* command resent, or answer NAKed */
+	long bytes_out, bytes_in;	/* payload */
+	long long total_us, min_us, max_us;
+	long long wait_us[3];	/* for the ACK, first and next answers */
+	long hist[STATS_BUCKETS];
+};
+
+struct link_stats {
+	long long start_us;
+	long frames_out, frames_in;
+	long bytes_out, bytes_in;	/* on the wire */
+	long naks_out, naks_in;
+	long timeouts;
+	long parity_errors;	/* seen by get_byte() */
+	long frame_errors[STATS_ERRORS];
+	long long idle_us;	/* waiting for input */
+	long long writer_us;	/* waiting for the writer thread */
+	struct op_stats ops[256];
+};
+
+/* Monotonic clock, in microseconds */
+long long stats_usec (void);
+
+void stats_init (struct link_stats *st);
+
+/* Account for one command (or upload frame) "op" which took "us" */
+void stats_command (struct link_stats *st, int op, long long us);
+
+/* One JSON object for the link */
+void stats_json (FILE *fd, const char *device, const struct link_stats *st);
+
+#endif
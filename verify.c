@@ -0,0 +1,535 @@
+/*
+ * Verification of the downloaded pictures. See verify.h.
+ *
+ * Released in the public domain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "exif.h"
+#include "sha256.h"
+#include "archive.h"
+#include "verify.h"
+
+#define MAX_WORKERS	4
+
+struct verify_item {
+	char *path;
+	const char *tag;
+	const char *id;
+	int *result;
+	int error, dir_error;	/* of the sync */
+	struct verify_item *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[MAX_WORKERS], syncer;
+static int nworkers, durable;
+static struct verify_item *head, *tail;
+static struct verify_item *unsynced;	/* good, waiting for the syncer */
+static int pending;		/* queued, being verified or synced */
+static int failures;
+static int stopping, sync_stop;
+static int manifest_fd = -1;
+static long manifest_end;
+
+/* The files listed in the manifest, and where */
+struct listed {
+	long offset;
+	char hash[2*SHA256_SIZE+1];
+	struct listed *next;
+	char path[1];		/* allocated with it */
+};
+
+static struct listed **listed;	/* hashed by path */
+static unsigned long nbuckets, nlisted;
+
+const char *jpeg_check (const unsigned char *buf, long len)
+{
+	struct exif_info ex;
+	const unsigned char *p;
+	long pos, seglen;
+	int marker, scans = 0;
+
+	if (len < 4 || buf[0] != 0xFF || buf[1] != 0xD8)
+		return "no SOI marker";
+	if (exif_parse(buf, len < 65536 ? len : 65536, &ex) < 0)
+		return "no Exif header";
+	pos = 2;
+	while (1) {
+		if (pos + 2 > len)
+			return "truncated (no EOI marker)";
+		if (buf[pos] != 0xFF)
+			return "bad marker";
+		marker = buf[pos+1];
+		if (marker == 0xFF) {
+			/* Fill byte */
+			pos++;
+			continue;
+		}
+		if (marker == 0xD9)
+			break;
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+			pos += 2;
+			continue;
+		}
+		if (pos + 4 > len)
+			return "truncated segment";
+		seglen = (buf[pos+2] << 8) | buf[pos+3];
+		if (seglen < 2)
+			return "bad segment length";
+		pos += 2 + seglen;
+		if (pos > len)
+			return "truncated segment";
+		if (marker != 0xDA)
+			continue;
+		/* The entropy-coded data, up to the next marker */
+		scans++;
+		while (1) {
+			p = memchr(buf + pos, 0xFF, len - pos);
+			if (p == NULL || p + 1 >= buf + len)
+				return "truncated scan (no EOI marker)";
+			pos = p - buf;
+			marker = p[1];
+			if (marker == 0x00 || (marker >= 0xD0 && marker <= 0xD7))
+				pos += 2;	/* stuffed byte, or restart */
+			else if (marker == 0xFF)
+				pos++;
+			else
+				break;
+		}
+	}
+	if (!scans)
+		return "no image data";
+	/* The camera may pad the file */
+	for (pos += 2; pos < len; pos++)
+		if (buf[pos] != 0x00 && buf[pos] != 0xFF)
+			return "data after the EOI marker";
+	return NULL;
+}
+
+static unsigned long path_hash (const char *path)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*path)
+		h = (h ^ (unsigned char) *path++) * 16777619UL;
+	return h;
+}
+
+/* With the lock held */
+static struct listed *find_listed (const char *path)
+{
+	struct listed *l;
+
+	if (!nbuckets)
+		return NULL;
+	for (l = listed[path_hash(path) & (nbuckets - 1)]; l; l = l->next)
+		if (!strcmp(l->path, path))
+			return l;
+	return NULL;
+}
+
+/* With the lock held */
+static struct listed *add_listed (const char *path, long offset)
+{
+	struct listed *l, **t, *next;
+	unsigned long i, n;
+
+	if (nlisted >= nbuckets) {
+		n = nbuckets ? 2*nbuckets : 256;
+		if ((t = calloc(n, sizeof(struct listed *))) == NULL)
+			return NULL;
+		for (i = 0; i < nbuckets; i++)
+			for (l = listed[i]; l; l = next) {
+				next = l->next;
+				l->next = t[path_hash(l->path) & (n - 1)];
+				t[path_hash(l->path) & (n - 1)] = l;
+			}
+		free(listed);
+		listed = t;
+		nbuckets = n;
+	}
+	if ((l = malloc(sizeof(struct listed) + strlen(path))) == NULL)
+		return NULL;
+	strcpy(l->path, path);
+	l->offset = offset;
+	l->hash[0] = '\0';
+	i = path_hash(path) & (nbuckets - 1);
+	l->next = listed[i];
+	listed[i] = l;
+	nlisted++;
+	return l;
+}
+
+static void free_listed (void)
+{
+	struct listed *l, *next;
+	unsigned long i;
+
+	for (i = 0; i < nbuckets; i++)
+		for (l = listed[i]; l; l = next) {
+			next = l->next;
+			free(l);
+		}
+	free(listed);
+	listed = NULL;
+	nbuckets = nlisted = 0;
+}
+
+/*
+ * Index the lines of the manifest, "HASH  PATH": a file verified again
+ * then gets its line rewritten in place (it has the same length), and
+ * an unchanged one isn't written at all. With the lock held.
+ */
+static int load_manifest (FILE *fd)
+{
+	char line[1200];
+	struct listed *l;
+	long offset = 0;
+	int len, n;
+
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		len = strlen(line);
+		/* An incomplete line is overwritten */
+		if (line[len-1] != '\n')
+			break;
+		line[len-1] = '\0';
+		n = strspn(line, "0123456789abcdef");
+		if (n == 2*SHA256_SIZE && !strncmp(line + n, "  ", 2) && line[n+2]) {
+			if ((l = find_listed(line + n + 2)) == NULL
+			    && (l = add_listed(line + n + 2, offset)) == NULL)
+				return -1;
+			l->offset = offset;
+			memcpy(l->hash, line, n);
+			l->hash[n] = '\0';
+		}
+		offset += len;
+	}
+	manifest_end = offset;
+	return 0;
+}
+
+/* Check a file, and hash it into the manifest (and the archive index) */
+static int verify_file (const char *path, const char *tag, const char *id)
+{
+	char line[1200], hex[2*SHA256_SIZE+1];
+	const char *problem;
+	unsigned char *data;
+	struct listed *l;
+	struct stat st;
+	long offset = -1;
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%sCannot verify %s: %s\n", tag, path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	data = (st.st_size > 0) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+		: NULL;
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "%sCannot verify %s: %s\n", tag, path, strerror(errno));
+		return -1;
+	}
+	problem = jpeg_check(data, st.st_size);
+	sha256_hex(data, st.st_size, hex);
+	if (data != NULL)
+		munmap(data, st.st_size);
+	if (problem != NULL) {
+		fprintf(stderr, "%s%s: bad JPEG file, %s\n", tag, path, problem);
+		return -1;
+	}
+	/* Only the good files, one line each, at its place */
+	n = snprintf(line, sizeof(line), "%s  %s\n", hex, path);
+	pthread_mutex_lock(&lock);
+	if (manifest_fd >= 0 && (l = find_listed(path)) != NULL) {
+		if (strcmp(l->hash, hex)) {
+			strcpy(l->hash, hex);
+			offset = l->offset;
+		}
+	} else if (manifest_fd >= 0 && (l = add_listed(path, manifest_end)) != NULL) {
+		strcpy(l->hash, hex);
+		offset = manifest_end;
+		manifest_end += n;
+	}
+	fd = manifest_fd;
+	pthread_mutex_unlock(&lock);
+	if (offset >= 0 && pwrite(fd, line, n, offset) != n)
+		fprintf(stderr, "%sCannot write the manifest: %s\n", tag, strerror(errno));
+	if (id != NULL)
+		archive_add(id, path, st.st_size, hex);
+	return 0;
+}
+
+static void *verify_thread (void *arg)
+{
+	struct verify_item *it;
+	int ok;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (head == NULL && !stopping)
+			pthread_cond_wait(&cond, &lock);
+		if ((it = head) == NULL)
+			break;
+		if ((head = it->next) == NULL)
+			tail = NULL;
+		pthread_mutex_unlock(&lock);
+		ok = (verify_file(it->path, it->tag, it->id) == 0);
+		pthread_mutex_lock(&lock);
+		if (ok && durable) {
+			it->next = unsynced;
+			unsynced = it;
+			pthread_cond_broadcast(&cond);
+			continue;
+		}
+		if (!ok)
+			failures++;
+		*it->result = ok ? VERIFY_OK : VERIFY_BAD;
+		pending--;
+		pthread_cond_broadcast(&cond);
+		free(it->path);
+		free(it);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* The directory of "path", into "dir" */
+static const char *dir_of (const char *path, char *dir)
+{
+	const char *slash = strrchr(path, '/');
+
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else
+		snprintf(dir, 1024, "%.*s", (int) (slash - path + 1), path);
+	return dir;
+}
+
+/* fsync() a file or directory. Returns 0, or errno */
+static int sync_path (const char *path, int data_only)
+{
+	int fd, ret = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return errno;
+	if ((data_only ? fdatasync(fd) : fsync(fd)) < 0)
+		ret = errno;
+	close(fd);
+	return ret;
+}
+
+/*
+ * Group commit: the pictures verified while the previous batch was being
+ * synced make the next batch. Their data are synced, then each of their
+ * directories once (for the new names) and the manifest, and only then
+ * are they complete.
+ */
+static void *sync_thread (void *arg)
+{
+	struct verify_item *batch, *it, *d, *next;
+	char dir[1024], other[1024];
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (unsynced == NULL && !sync_stop)
+			pthread_cond_wait(&cond, &lock);
+		if ((batch = unsynced) == NULL)
+			break;
+		unsynced = NULL;
+		pthread_mutex_unlock(&lock);
+		for (it = batch; it; it = it->next)
+			it->error = sync_path(it->path, 1);
+		for (it = batch; it; it = it->next) {
+			dir_of(it->path, dir);
+			for (d = batch; d != it; d = d->next)
+				if (!strcmp(dir_of(d->path, other), dir))
+					break;
+			/* Each directory once */
+			it->dir_error = (d == it) ? sync_path(dir, 0) : d->dir_error;
+			if (!it->error)
+				it->error = it->dir_error;
+		}
+		if (manifest_fd >= 0)
+			fdatasync(manifest_fd);
+		pthread_mutex_lock(&lock);
+		for (it = batch; it; it = next) {
+			next = it->next;
+			if (it->error) {
+				fprintf(stderr, "%sCannot sync %s: %s\n", it->tag, it->path,
+					strerror(it->error));
+				failures++;
+			}
+			*it->result = it->error ? VERIFY_BAD : VERIFY_OK;
+			pending--;
+			free(it->path);
+			free(it);
+		}
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+int verify_start (const char *manifest, int sync)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int ret = 0;
+	FILE *fd;
+
+	pthread_mutex_lock(&lock);
+	if (nworkers)
+		goto out;
+	manifest_fd = open(manifest, O_RDWR|O_CREAT, 0666);
+	if (manifest_fd < 0 || (fd = fdopen(dup(manifest_fd), "r")) == NULL) {
+		ret = -1;
+		goto fail;
+	}
+	ret = load_manifest(fd);
+	fclose(fd);
+	if (ret < 0)
+		goto fail;
+	if (cpus > MAX_WORKERS)
+		cpus = MAX_WORKERS;
+	stopping = sync_stop = 0;
+	durable = sync;
+	if (durable && pthread_create(&syncer, NULL, sync_thread, NULL) != 0) {
+		ret = -1;
+		goto fail;
+	}
+	while (nworkers < cpus || nworkers == 0) {
+		if (pthread_create(&workers[nworkers], NULL, verify_thread, NULL) != 0)
+			break;
+		nworkers++;
+	}
+	if (nworkers == 0) {
+		if (durable) {
+			sync_stop = 1;
+			pthread_cond_broadcast(&cond);
+			pthread_mutex_unlock(&lock);
+			pthread_join(syncer, NULL);
+			pthread_mutex_lock(&lock);
+		}
+		ret = -1;
+		goto fail;
+	}
+out:
+	pthread_mutex_unlock(&lock);
+	return ret;
+fail:
+	if (manifest_fd >= 0)
+		close(manifest_fd);
+	manifest_fd = -1;
+	free_listed();
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void verify_submit (const char *path, const char *tag, const char *id, int *result)
+{
+	struct verify_item *it;
+
+	*result = VERIFY_PENDING;
+	it = malloc(sizeof(struct verify_item));
+	if (it == NULL || (it->path = strdup(path)) == NULL) {
+		fprintf(stderr, "%sCannot verify %s: out of memory\n", tag, path);
+		free(it);
+		*result = VERIFY_BAD;
+		return;
+	}
+	it->tag = tag;
+	it->id = id;
+	it->result = result;
+	it->next = NULL;
+	pthread_mutex_lock(&lock);
+	if (!nworkers) {
+		/* Not started: nothing to do */
+		pthread_mutex_unlock(&lock);
+		free(it->path);
+		free(it);
+		*result = VERIFY_OK;
+		return;
+	}
+	if (tail)
+		tail->next = it;
+	else
+		head = it;
+	tail = it;
+	pending++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+int verify_wait (int *result)
+{
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	while (*result == VERIFY_PENDING)
+		pthread_cond_wait(&cond, &lock);
+	ret = *result;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+int verify_poll (int *result)
+{
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	ret = *result;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+int verify_sync (void)
+{
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	while (pending)
+		pthread_cond_wait(&cond, &lock);
+	ret = failures;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void verify_stop (void)
+{
+	int i, n;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	n = nworkers;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < n; i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_lock(&lock);
+	if (n && durable) {
+		/* The workers are done: the last batch */
+		sync_stop = 1;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		pthread_join(syncer, NULL);
+		pthread_mutex_lock(&lock);
+	}
+	nworkers = 0;
+	if (manifest_fd >= 0)
+		close(manifest_fd);
+	manifest_fd = -1;
+	free_listed();
+	pthread_mutex_unlock(&lock);
+}
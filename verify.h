@@ -0,0 +1,53 @@
+/*
+ * Verification of the downloaded pictures, by worker threads: the JPEG
+ * structure is checked, and the SHA-256 of each good file is recorded in
+ * a manifest, in the format of sha256sum(1), in place of the line of a
+ * file verified again. This is done while the next picture is
+ * transferred. Optionally, the good files are then synced to the disk by
+ * another thread, in batches, before they are complete.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#define VERIFY_PENDING	-1
+#define VERIFY_BAD	0
+#define VERIFY_OK	1
+
+/*
+ * Check the structure of a JPEG file: SOI, the segments (including an
+ * Exif header), the scans up to EOI, and nothing but padding after it.
+ * Returns NULL if it's fine, or what's wrong.
+ */
+const char *jpeg_check (const unsigned char *buf, long len);
+
+/*
+ * Start the workers (once), writing to "manifest", and with "sync" the
+ * syncer. Returns -1, with errno set, if the manifest can't be opened.
+ */
+int verify_start (const char *manifest, int sync);
+
+/*
+ * Queue the file "path" for verification. *result is VERIFY_PENDING
+ * until it's done (and synced), then VERIFY_OK or VERIFY_BAD; problems are reported
+ * on stderr, prefixed with "tag". A good file is also added to the
+ * archive index, as coming from camera "id", unless it's NULL. Both
+ * strings must remain valid.
+ */
+void verify_submit (const char *path, const char *tag, const char *id, int *result);
+
+/* Wait until *result is known, and return it */
+int verify_wait (int *result);
+
+/* The same, without waiting */
+int verify_poll (int *result);
+
+/* Wait until the queue is empty. Returns the number of bad files so far */
+int verify_sync (void);
+
+/* Complete the queue, and stop the workers */
+void verify_stop (void);
+
+#endif
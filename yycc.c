@@ -0,0 +1,127 @@
+/*
+ * YYCbCr to RGB conversion. See yycc.h.
+ *
+ * Released in the public domain.
+ */
+
+#include "yycc.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static unsigned char clamp (int x)
+{
+	if (x < 0)
+	  x = 0;
+	if (x > 255)
+	  x = 255;
+	return x;
+}
+
+void yycc_to_rgb_c (unsigned char *rgb, const unsigned char *yycc, int groups)
+{
+	int Y1, Y2, Cb, Cr, Roff, Goff, Boff;
+
+	while (groups-- > 0) {
+		Y1 = yycc[0];
+		Y2 = yycc[1];
+		Cb = yycc[2] - 128;
+		Cr = yycc[3] - 128;
+		Roff = (359*Cr + 128) >> 8;
+		Goff = (-88*Cb -183*Cr + 128) >> 8;
+		Boff = (454*Cb + 128) >> 8;
+		rgb[0] = clamp(Y1+Roff); rgb[1] = clamp(Y1+Goff); rgb[2] = clamp(Y1+Boff);
+		rgb[3] = clamp(Y2+Roff); rgb[4] = clamp(Y2+Goff); rgb[5] = clamp(Y2+Boff);
+		yycc += 4;
+		rgb += 6;
+	}
+}
+
+#ifdef __SSE2__
+/* Squeeze 4 pixels R G B 0 into 12 bytes R G B (and 4 zeros) */
+static __m128i pack_rgb (__m128i p)
+{
+	__m128i x;
+
+	x = _mm_or_si128(_mm_and_si128(p, _mm_set1_epi64x(0xFFFFFF)),
+		_mm_and_si128(_mm_srli_epi64(p, 8), _mm_set1_epi64x(0xFFFFFF000000LL)));
+	return _mm_or_si128(_mm_and_si128(x, _mm_set_epi64x(0, -1)),
+		_mm_srli_si128(_mm_and_si128(x, _mm_set_epi64x(-1, 0)), 2));
+}
+
+/* Chroma offset of 4 groups, given the (Cb, Cr) coefficients "k" */
+static __m128i offset (__m128i cc, __m128i k)
+{
+	return _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(cc, k),
+		_mm_set1_epi32(128)), 8);
+}
+
+/*
+ * Convert 8 groups (16 pixels) into 48 bytes, with the same fixed point
+ * arithmetic as yycc_to_rgb_c(): the products are done on 32 bits by
+ * pmaddwd, and packuswb does the clamping. 4 more bytes are written
+ * after the end.
+ */
+static void yycc_block (unsigned char *out, const unsigned char *in)
+{
+	const __m128i lo8 = _mm_set1_epi32(0xFF);
+	const __m128i kr = _mm_set_epi16(359, 0, 359, 0, 359, 0, 359, 0);
+	const __m128i kg = _mm_set_epi16(-183, -88, -183, -88, -183, -88, -183, -88);
+	const __m128i kb = _mm_set_epi16(0, 454, 0, 454, 0, 454, 0, 454);
+	__m128i a, b, cca, ccb, y1, y2, r, g, bl, R, G, B, rg, bz;
+
+	/* Each 32-bit lane is a group: Y1, Y2, Cb, Cr */
+	a = _mm_loadu_si128((const __m128i *) in);
+	b = _mm_loadu_si128((const __m128i *) (in + 16));
+	y1 = _mm_packs_epi32(_mm_and_si128(a, lo8), _mm_and_si128(b, lo8));
+	y2 = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi16(a, 8), lo8),
+			     _mm_and_si128(_mm_srli_epi16(b, 8), lo8));
+
+	/* Cb-128 and Cr-128 in the low and high halves of each lane */
+	cca = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(a, 16), lo8),
+		_mm_andnot_si128(_mm_set1_epi32(0xFFFF), _mm_srli_epi16(a, 8)));
+	ccb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(b, 16), lo8),
+		_mm_andnot_si128(_mm_set1_epi32(0xFFFF), _mm_srli_epi16(b, 8)));
+	cca = _mm_sub_epi16(cca, _mm_set1_epi16(128));
+	ccb = _mm_sub_epi16(ccb, _mm_set1_epi16(128));
+
+	r = _mm_packs_epi32(offset(cca, kr), offset(ccb, kr));
+	g = _mm_packs_epi32(offset(cca, kg), offset(ccb, kg));
+	bl = _mm_packs_epi32(offset(cca, kb), offset(ccb, kb));
+
+	/* Y1 and Y2 pixels, then in the order of the pixels */
+	R = _mm_packus_epi16(_mm_add_epi16(y1, r), _mm_add_epi16(y2, r));
+	G = _mm_packus_epi16(_mm_add_epi16(y1, g), _mm_add_epi16(y2, g));
+	B = _mm_packus_epi16(_mm_add_epi16(y1, bl), _mm_add_epi16(y2, bl));
+	R = _mm_unpacklo_epi8(R, _mm_srli_si128(R, 8));
+	G = _mm_unpacklo_epi8(G, _mm_srli_si128(G, 8));
+	B = _mm_unpacklo_epi8(B, _mm_srli_si128(B, 8));
+
+	rg = _mm_unpacklo_epi8(R, G);
+	bz = _mm_unpacklo_epi8(B, _mm_setzero_si128());
+	_mm_storeu_si128((__m128i *) out, pack_rgb(_mm_unpacklo_epi16(rg, bz)));
+	_mm_storeu_si128((__m128i *) (out + 12), pack_rgb(_mm_unpackhi_epi16(rg, bz)));
+	rg = _mm_unpackhi_epi8(R, G);
+	bz = _mm_unpackhi_epi8(B, _mm_setzero_si128());
+	_mm_storeu_si128((__m128i *) (out + 24), pack_rgb(_mm_unpacklo_epi16(rg, bz)));
+	_mm_storeu_si128((__m128i *) (out + 36), pack_rgb(_mm_unpackhi_epi16(rg, bz)));
+}
+#endif
+
+void yycc_to_rgb (unsigned char *rgb, const unsigned char *yycc, int groups)
+{
+#ifdef __SSE2__
+	/*
+	 * The bytes written past a block belong to the next group, so
+	 * the last block is left to the scalar code.
+	 */
+	while (groups > 8) {
+		yycc_block(rgb, yycc);
+		yycc += 32;
+		rgb += 48;
+		groups -= 8;
+	}
+#endif
+	yycc_to_rgb_c(rgb, yycc, groups);
+}
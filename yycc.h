@@ -0,0 +1,22 @@
+/*
+ * The preview format of the camera: a 4-byte header (width and height,
+ * little-endian) followed by groups of 4 bytes, Y1 Y2 Cb Cr, for two
+ * horizontally adjacent pixels sharing their chroma.
+ *
+ * Released in the public domain.
+ */
+
+#ifndef YYCC_H
+#define YYCC_H
+
+#define YYCC_HEADER	4
+
+/*
+ * Convert "groups" groups of YYCbCr into 6*groups bytes of RGB.
+ * yycc_to_rgb_c() is the reference implementation, yycc_to_rgb() the
+ * fast one; both give the same results.
+ */
+void yycc_to_rgb (unsigned char *rgb, const unsigned char *yycc, int groups);
+void yycc_to_rgb_c (unsigned char *rgb, const unsigned char *yycc, int groups);
+
+#endif
@@ -10,36 +10,36 @@
  */
 
 #include <stdio.h>
-
-static int putcc (int x)
-{
-	if (x < 0)
-	  x = 0;
-	if (x > 255)
-	  x = 255;
-	return putchar(x);
-}
+#include <stdlib.h>
+#include "yycc.h"
 
 int main (void)
 {
-	unsigned char c[4];
-	int width, height, Y1, Y2, Cb, Cr, Roff, Goff, Boff;
+	unsigned char *in, *out, *p;
+	long len = 0, size = 65536, groups;
+	int width, height, n, hlen;
 
-	if (fread(c,1,4,stdin) != 4)
+	/* Read the whole preview */
+	if ((in = malloc(size)) == NULL)
 		return 1;
-	width  = c[0] + 256 * c[1];
-	height = c[2] + 256 * c[3];
-	printf("P6\n%d %d\n255\n", width, height);
-	while (fread(c,1,4,stdin) == 4) {
-		Y1 = c[0];
-		Y2 = c[1];
-		Cb = c[2] - 128;
-		Cr = c[3] - 128;
-		Roff = (359*Cr + 128) >> 8;
-		Goff = (-88*Cb -183*Cr + 128) >> 8;
-		Boff = (454*Cb + 128) >> 8;
-		putcc(Y1+Roff); putcc(Y1+Goff); putcc(Y1+Boff);
-		putcc(Y2+Roff); putcc(Y2+Goff); putcc(Y2+Boff);
+	while ((n = fread(in+len, 1, size-len, stdin)) > 0) {
+		len += n;
+		if (len == size && (in = realloc(in, size *= 2)) == NULL)
+			return 1;
 	}
-	return 0;
+	if (len < YYCC_HEADER)
+		return 1;
+	width  = in[0] + 256 * in[1];
+	height = in[2] + 256 * in[3];
+	groups = (len - YYCC_HEADER) / 4;
+
+	/* Convert it, and write it at once */
+	if ((out = malloc(32 + 6*groups)) == NULL)
+		return 1;
+	hlen = sprintf((char *)out, "P6\n%d %d\n255\n", width, height);
+	p = out + hlen;
+	yycc_to_rgb(p, in + YYCC_HEADER, groups);
+	if (fwrite(out, 1, hlen + 6*groups, stdout) != hlen + 6*groups)
+		return 1;
+	return fflush(stdout) != 0;
 }